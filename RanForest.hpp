@@ -1,7 +1,14 @@
 #pragma once
 
 #include "kernels/VP.hpp"
+#include "kernels/InfoGain.hpp"
 #include "tree/tree.hpp"
+#include "tree/lazy.hpp"
+#include "tree/level.hpp"
+#include "tree/binary.hpp"
+#include "tree/oob.hpp"
+#include "tree/affinity.hpp"
 #include "clustering/TMeanShell.hpp"
+#include "search/NNSearch.hpp"
 
 
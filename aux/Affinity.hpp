@@ -0,0 +1,161 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+//
+// This file implements AffinityGraph, a sparse weighted graph over a
+// set of points in compressed sparse row (CSR) form, as built by
+// LeafAffinity::topAffinity() (see tree/affinity.hpp), and CountTable, the
+// open addressing hash table that accumulates the weights of a row.
+
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+namespace ran_forest
+{
+  struct AffinityGraph
+  {
+    // the edges of point i are cols[offsets[i]], ..., cols[offsets[i + 1] - 1],
+    // in ascending order, with weights at the same positions
+    std::vector<size_t> offsets;
+    std::vector<uint32_t> cols;
+    std::vector<float> weights;
+
+    AffinityGraph() : offsets( 1, 0 ), cols(), weights() {}
+
+    inline size_t size() const
+    {
+      return offsets.size() - 1;
+    }
+
+    inline size_t numEdges() const
+    {
+      return cols.size();
+    }
+
+    inline size_t degree( size_t i ) const
+    {
+      return offsets[i + 1] - offsets[i];
+    }
+
+    // The graph with an edge (i, j) wherever (i, j) or (j, i) is an
+    // edge of this one, weighted by the larger of the two weights.
+    AffinityGraph symmetrize() const
+    {
+      size_t n = size();
+      std::vector<size_t> count( n + 1, 0 );
+      for ( size_t i=0; i<n; i++ ) {
+        count[i + 1] += degree( i );
+        for ( size_t e=offsets[i]; e<offsets[i + 1]; e++ ) count[cols[e] + 1]++;
+      }
+      for ( size_t i=0; i<n; i++ ) count[i + 1] += count[i];
+      std::vector<std::pair<uint32_t, float> > all( count[n] );
+      std::vector<size_t> pos( count.begin(), count.end() - 1 );
+      for ( size_t i=0; i<n; i++ ) {
+        for ( size_t e=offsets[i]; e<offsets[i + 1]; e++ ) {
+          all[pos[i]++] = std::make_pair( cols[e], weights[e] );
+          all[pos[cols[e]]++] = std::make_pair( static_cast<uint32_t>( i ), weights[e] );
+        }
+      }
+
+      AffinityGraph re;
+      re.offsets.resize( n + 1 );
+      re.offsets[0] = 0;
+      for ( size_t i=0; i<n; i++ ) {
+        std::sort( all.begin() + count[i], all.begin() + count[i + 1] );
+        for ( size_t e=count[i]; e<count[i + 1]; e++ ) {
+          if ( re.offsets[i] < re.cols.size() && re.cols.back() == all[e].first ) {
+            re.weights.back() = std::max( re.weights.back(), all[e].second );
+          } else {
+            re.cols.push_back( all[e].first );
+            re.weights.push_back( all[e].second );
+          }
+        }
+        re.offsets[i + 1] = re.cols.size();
+      }
+      return re;
+    }
+  };
+
+
+  // Counts keyed by point index, cleared in time proportional to the
+  // number of keys inserted since the last clear().
+  class CountTable
+  {
+  private:
+    enum : uint32_t { EMPTY = 0xFFFFFFFFu };
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> counts;
+    // the slots in use, in insertion order
+    std::vector<size_t> used;
+    size_t mask;
+
+    inline size_t slot( uint32_t key ) const
+    {
+      size_t h = ( static_cast<uint64_t>( key ) * 0x9E3779B97F4A7C15ULL ) >> 20;
+      h &= mask;
+      while ( EMPTY != keys[h] && key != keys[h] ) h = ( h + 1 ) & mask;
+      return h;
+    }
+
+    void grow()
+    {
+      std::vector<uint32_t> oldKeys;
+      std::vector<uint32_t> oldCounts;
+      oldKeys.swap( keys );
+      oldCounts.swap( counts );
+      keys.assign( oldKeys.size() * 2, EMPTY );
+      counts.assign( oldCounts.size() * 2, 0 );
+      mask = keys.size() - 1;
+      for ( auto& s : used ) {
+        size_t h = slot( oldKeys[s] );
+        keys[h] = oldKeys[s];
+        counts[h] = oldCounts[s];
+        s = h;
+      }
+    }
+
+  public:
+    CountTable() : keys( 1024, EMPTY ), counts( 1024, 0 ), used(), mask( 1023 ) {}
+
+    inline void add( uint32_t key )
+    {
+      size_t h = slot( key );
+      if ( EMPTY == keys[h] ) {
+        keys[h] = key;
+        used.push_back( h );
+        // keep the load factor below 1/2
+        if ( used.size() * 2 > keys.size() ) {
+          grow();
+          h = slot( key );
+        }
+      }
+      counts[h]++;
+    }
+
+    inline size_t size() const
+    {
+      return used.size();
+    }
+
+    // Append the (key, count) pairs to @param out.
+    inline void dump( std::vector<std::pair<uint32_t, uint32_t> > &out ) const
+    {
+      for ( auto& s : used ) out.push_back( std::make_pair( keys[s], counts[s] ) );
+    }
+
+    inline void clear()
+    {
+      for ( auto& s : used ) {
+        keys[s] = EMPTY;
+        counts[s] = 0;
+      }
+      used.clear();
+    }
+  };
+}
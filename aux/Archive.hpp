@@ -0,0 +1,250 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+// 
+// This file implements OutArchive and InArchive, in-memory byte
+// buffers used for serialization. An OutArchive is filled in memory
+// and then written to disk with a single call, followed by a 64 bit
+// checksum of its contents. An InArchive reads a whole file with a
+// single call, and can verify that checksum before anything is
+// decoded. Compared with many small fread()/fwrite() calls, this
+// keeps the I/O in large sequential blocks, lets several files be
+// (de)serialized in parallel without sharing any FILE*, and detects
+// truncated or corrupted files reliably.
+
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace ran_forest
+{
+  // A fast 64 bit checksum, consuming 8 bytes per step.
+  inline uint64_t checksum( const char *data, size_t len )
+  {
+    const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = 0xCBF29CE484222325ULL ^ ( len * prime );
+    size_t i = 0;
+    for ( ; i + 8 <= len; i += 8 ) {
+      uint64_t w;
+      memcpy( &w, data + i, 8 );
+      h = ( h ^ w ) * prime;
+      h ^= h >> 32;
+    }
+    uint64_t w = 0;
+    if ( i < len ) memcpy( &w, data + i, len - i );
+    h = ( h ^ w ) * prime;
+    h ^= h >> 29;
+    return h;
+  }
+
+  
+  class OutArchive
+  {
+  private:
+    std::vector<char> bytes;
+    
+  public:
+    OutArchive() : bytes() {}
+
+    inline void write( const void *src, size_t len )
+    {
+      const char *p = static_cast<const char*>( src );
+      bytes.insert( bytes.end(), p, p + len );
+    }
+
+    template <typename T>
+    inline void put( const T &value )
+    {
+      write( &value, sizeof(T) );
+    }
+
+    template <typename T, typename A>
+    inline void putVector( const std::vector<T,A> &vec )
+    {
+      uint64_t len = vec.size();
+      put( len );
+      if ( 0 < len ) write( &vec[0], sizeof(T) * len );
+    }
+
+    // unsigned LEB128, 7 bits per byte
+    inline void putVarint( uint64_t value )
+    {
+      while ( 0x80 <= value ) {
+        bytes.push_back( static_cast<char>( ( value & 0x7f ) | 0x80 ) );
+        value >>= 7;
+      }
+      bytes.push_back( static_cast<char>( value ) );
+    }
+
+    inline size_t size() const
+    {
+      return bytes.size();
+    }
+
+    inline const char* data() const
+    {
+      return bytes.data();
+    }
+
+    // Move the contents followed by their checksum into @param
+    // message, which is the in-memory counterpart of save(), e.g. for
+    // sending them to another process. The archive is left empty.
+    inline void seal( std::vector<char> &message )
+    {
+      uint64_t sum = checksum( bytes.data(), bytes.size() );
+      put( sum );
+      message.swap( bytes );
+      bytes.clear();
+    }
+
+    // Write the contents followed by their checksum to @param
+    // filename. Returns false on failure.
+    bool save( const std::string &filename ) const
+    {
+      FILE *out = fopen( filename.c_str(), "wb" );
+      if ( nullptr == out ) return false;
+      uint64_t sum = checksum( bytes.data(), bytes.size() );
+      bool ok = bytes.size() == fwrite( bytes.data(), 1, bytes.size(), out );
+      ok = ok && ( 1 == fwrite( &sum, sizeof(uint64_t), 1, out ) );
+      return ( 0 == fclose( out ) ) && ok;
+    }
+  };
+
+
+  class InArchive
+  {
+  private:
+    std::vector<char> bytes;
+    // the read position and the end of the readable contents
+    size_t pos;
+    size_t end;
+    // false once a read went past the end
+    bool ok;
+
+  public:
+    InArchive() : bytes(), pos(0), end(0), ok(true) {}
+
+    // Read the whole of @param filename. Returns false on failure.
+    bool load( const std::string &filename )
+    {
+      bytes.clear();
+      pos = end = 0;
+      ok = true;
+      FILE *in = fopen( filename.c_str(), "rb" );
+      if ( nullptr == in ) return false;
+      fseek( in, 0, SEEK_END );
+      long len = ftell( in );
+      fseek( in, 0, SEEK_SET );
+      if ( 0 <= len ) {
+        bytes.resize( static_cast<size_t>( len ) );
+        end = fread( bytes.data(), 1, bytes.size(), in );
+      }
+      fclose( in );
+      return 0 <= len && end == bytes.size();
+    }
+
+    // Check the trailing checksum written by OutArchive::save(), and
+    // exclude it from the readable contents.
+    bool verify()
+    {
+      if ( end < sizeof(uint64_t) ) return false;
+      uint64_t sum = 0;
+      memcpy( &sum, bytes.data() + end - sizeof(uint64_t), sizeof(uint64_t) );
+      if ( sum != checksum( bytes.data(), end - sizeof(uint64_t) ) ) return false;
+      end -= sizeof(uint64_t);
+      return true;
+    }
+
+    inline void read( void *dst, size_t len )
+    {
+      if ( pos + len > end ) {
+        ok = false;
+        memset( dst, 0, len );
+        pos = end;
+        return;
+      }
+      memcpy( dst, bytes.data() + pos, len );
+      pos += len;
+    }
+
+    template <typename T>
+    inline void get( T &value )
+    {
+      read( &value, sizeof(T) );
+    }
+
+    template <typename T, typename A>
+    inline void getVector( std::vector<T,A> &vec )
+    {
+      uint64_t len = 0;
+      get( len );
+      if ( len > ( end - pos ) / sizeof(T) ) {
+        fail();
+        len = 0;
+      }
+      vec.resize( len );
+      if ( 0 < len ) read( &vec[0], sizeof(T) * len );
+    }
+
+    inline void getVarint( uint64_t &value )
+    {
+      value = 0;
+      for ( int shift=0; shift<64; shift+=7 ) {
+        if ( pos >= end ) {
+          ok = false;
+          return;
+        }
+        unsigned char byte = static_cast<unsigned char>( bytes[pos++] );
+        value |= static_cast<uint64_t>( byte & 0x7f ) << shift;
+        if ( 0 == ( byte & 0x80 ) ) return;
+      }
+      ok = false;
+    }
+
+    // Replace the unread contents with @param contents, e.g. the
+    // decompressed version of them.
+    inline void assign( std::vector<char> &&contents )
+    {
+      bytes.swap( contents );
+      pos = 0;
+      end = bytes.size();
+    }
+
+    // the unread contents
+    inline const char* cursor() const
+    {
+      return bytes.data() + pos;
+    }
+
+    inline size_t remain() const
+    {
+      return end - pos;
+    }
+
+    // mark the archive as broken, e.g. when a decoded length is not
+    // plausible
+    inline void fail()
+    {
+      ok = false;
+      pos = end;
+    }
+
+    // whether every read so far stayed within the contents
+    inline bool good() const
+    {
+      return ok;
+    }
+
+    // whether all the contents have been read
+    inline bool exhausted() const
+    {
+      return pos == end;
+    }
+  };
+}
@@ -0,0 +1,151 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+//
+// This file implements class Arena, a slab allocator for the many
+// small arrays of a forest (child lists, leaf stores and vantage
+// points), and ArenaAllocator, the standard allocator that places the
+// elements of a container in an Arena.
+//
+// An Arena hands out memory by bumping a pointer through large
+// chunks, and never frees anything on its own: deallocating an array
+// placed in an Arena does nothing, and all of its chunks are released
+// at once when the Arena is destroyed. Growing a forest therefore
+// costs a few large allocations instead of several per node, and
+// destroying it a few calls to free.
+//
+// An ArenaAllocator with no Arena (the default) falls back to the
+// heap, and copies of a container are always made on the heap, so that
+// only moves and swaps carry a reference to an Arena. The owner of the
+// containers must keep the Arena alive as long as any of them.
+
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <algorithm>
+
+namespace ran_forest
+{
+  class Arena
+  {
+  private:
+    enum : size_t { FIRST_CHUNK = 1 << 12, MAX_CHUNK = 1 << 22 };
+
+    std::vector<std::unique_ptr<char[]> > chunks;
+    char *head;
+    size_t left;
+    size_t nextChunk;
+    size_t total;
+    std::mutex lock;
+
+  public:
+    Arena() : chunks(), head(nullptr), left(0), nextChunk( FIRST_CHUNK ), total(0), lock() {}
+
+    Arena( const Arena& ) = delete;
+    Arena& operator=( const Arena& ) = delete;
+
+    // Return @param bytes bytes aligned for any fundamental type.
+    void* allocate( size_t bytes )
+    {
+      const size_t align = alignof( std::max_align_t );
+      bytes = ( bytes + align - 1 ) / align * align;
+      std::lock_guard<std::mutex> guard( lock );
+      if ( left < bytes ) {
+        // chunks grow geometrically, and oversized requests get a
+        // chunk of their own
+        size_t len = std::max<size_t>( nextChunk, bytes );
+        nextChunk = std::min<size_t>( nextChunk * 2, MAX_CHUNK );
+        chunks.emplace_back( new char[len] );
+        head = chunks.back().get();
+        left = len;
+        total += len;
+      }
+      void *re = head;
+      head += bytes;
+      left -= bytes;
+      return re;
+    }
+
+    // The number of bytes held in chunks.
+    inline size_t bytes() const
+    {
+      return total;
+    }
+  };
+
+
+  template <typename T>
+  class ArenaAllocator
+  {
+  public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    typedef std::false_type propagate_on_container_copy_assignment;
+
+    Arena *arena;
+
+    ArenaAllocator() : arena(nullptr) {}
+    explicit ArenaAllocator( Arena *arena ) : arena( arena ) {}
+    template <typename U>
+    ArenaAllocator( const ArenaAllocator<U> &other ) : arena( other.arena ) {}
+
+    inline T* allocate( size_t n )
+    {
+      if ( nullptr == arena ) return static_cast<T*>( ::operator new( n * sizeof(T) ) );
+      return static_cast<T*>( arena->allocate( n * sizeof(T) ) );
+    }
+
+    inline void deallocate( T *p, size_t __attribute__((__unused__)) n )
+    {
+      if ( nullptr == arena ) ::operator delete( p );
+    }
+
+    // copies go to the heap
+    inline ArenaAllocator select_on_container_copy_construction() const
+    {
+      return ArenaAllocator();
+    }
+
+    template <typename U>
+    struct rebind
+    {
+      typedef ArenaAllocator<U> other;
+    };
+  };
+
+  template <typename T, typename U>
+  inline bool operator==( const ArenaAllocator<T> &a, const ArenaAllocator<U> &b )
+  {
+    return a.arena == b.arena;
+  }
+
+  template <typename T, typename U>
+  inline bool operator!=( const ArenaAllocator<T> &a, const ArenaAllocator<U> &b )
+  {
+    return a.arena != b.arena;
+  }
+
+  template <typename T>
+  using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+
+  // Place the storage of @param judger in @param arena, for splitters
+  // providing bind( Arena* ), and do nothing for the others.
+  template <typename splitter_t>
+  inline auto bindArena( splitter_t &judger, Arena *arena, int ) -> decltype( judger.bind( arena ), void() )
+  {
+    judger.bind( arena );
+  }
+
+  template <typename splitter_t>
+  inline void bindArena( splitter_t __attribute__((__unused__)) &judger,
+                         Arena __attribute__((__unused__)) *arena, long ) {}
+}
@@ -0,0 +1,203 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+// 
+// This file implements the low level codecs used by the compact
+// serialization format:
+//
+// 1. conversion between float and IEEE 754 half precision (binary16),
+//    rounding to nearest even.
+//
+// 2. a byte oriented LZ77 block codec in the spirit of LZ4. A block
+//    is a sequence of (literals, match) pairs. Each pair starts with
+//    a token byte whose high nibble is the number of literals and low
+//    nibble is the match length minus 4, where 15 means that the
+//    value continues in the following bytes (each 255 adds up, the
+//    first byte below 255 ends it). The literals follow, and then the
+//    match as a 2 byte little endian offset back into the output and
+//    the length extension. The last pair of a block has no match.
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace ran_forest
+{
+  // +-------------------------------------------------------------------------------
+  // Half Precision
+  
+  inline uint16_t floatToHalf( float value )
+  {
+    uint32_t x = 0;
+    memcpy( &x, &value, 4 );
+    uint32_t sign = ( x >> 16 ) & 0x8000;
+    uint32_t mant = x & 0x7fffff;
+    int exp = static_cast<int>( ( x >> 23 ) & 0xff );
+
+    // infinity and NaN
+    if ( 0xff == exp ) return static_cast<uint16_t>( sign | 0x7c00 | ( mant ? 0x200 : 0 ) );
+
+    int e = exp - 127 + 15;
+    // overflow
+    if ( 0x1f <= e ) return static_cast<uint16_t>( sign | 0x7c00 );
+
+    // subnormal or zero
+    if ( e <= 0 ) {
+      if ( e < -10 ) return static_cast<uint16_t>( sign );
+      mant |= 0x800000;
+      int shift = 14 - e;
+      uint32_t half = mant >> shift;
+      uint32_t rem = mant & ( ( 1u << shift ) - 1 );
+      uint32_t mid = 1u << ( shift - 1 );
+      if ( rem > mid || ( rem == mid && ( half & 1 ) ) ) half++;
+      return static_cast<uint16_t>( sign | half );
+    }
+
+    // normal, a carry out of the mantissa correctly bumps the exponent
+    uint32_t half = sign | ( static_cast<uint32_t>( e ) << 10 ) | ( mant >> 13 );
+    uint32_t rem = mant & 0x1fff;
+    if ( rem > 0x1000 || ( rem == 0x1000 && ( half & 1 ) ) ) half++;
+    return static_cast<uint16_t>( half );
+  }
+
+  inline float halfToFloat( uint16_t half )
+  {
+    uint32_t sign = static_cast<uint32_t>( half & 0x8000 ) << 16;
+    uint32_t exp = ( half >> 10 ) & 0x1f;
+    uint32_t mant = half & 0x3ff;
+    uint32_t x = 0;
+    if ( 0 == exp ) {
+      // zero or subnormal, mant * 2^-24
+      float value = static_cast<float>( mant ) * ( 1.0f / 16777216.0f );
+      return sign ? -value : value;
+    } else if ( 0x1f == exp ) {
+      x = sign | 0x7f800000 | ( mant << 13 );
+    } else {
+      x = sign | ( ( exp - 15 + 127 ) << 23 ) | ( mant << 13 );
+    }
+    float value = 0.0f;
+    memcpy( &value, &x, 4 );
+    return value;
+  }
+
+
+  // +-------------------------------------------------------------------------------
+  // LZ Block Codec
+
+  namespace lz
+  {
+    const size_t MIN_MATCH = 4;
+    const int HASH_BITS = 16;
+    const size_t MAX_OFFSET = 0xffff;
+
+    inline uint32_t read32( const char *p )
+    {
+      uint32_t x = 0;
+      memcpy( &x, p, 4 );
+      return x;
+    }
+
+    inline void putLength( std::vector<char> &dst, size_t len )
+    {
+      while ( 255 <= len ) {
+        dst.push_back( static_cast<char>( 255 ) );
+        len -= 255;
+      }
+      dst.push_back( static_cast<char>( len ) );
+    }
+
+    // read a length extension, return false if the input runs out
+    inline bool getLength( const char *&ip, const char *end, size_t &len )
+    {
+      for (;;) {
+        if ( ip >= end ) return false;
+        unsigned char byte = static_cast<unsigned char>( *ip++ );
+        len += byte;
+        if ( 255 != byte ) return true;
+      }
+    }
+
+    inline void putSequence( std::vector<char> &dst, const char *literals, size_t numLiterals,
+                             size_t offset, size_t matchLen )
+    {
+      size_t m = 0 < matchLen ? matchLen - MIN_MATCH : 0;
+      unsigned char token = static_cast<unsigned char>( ( ( numLiterals < 15 ? numLiterals : 15 ) << 4 ) |
+                                                        ( m < 15 ? m : 15 ) );
+      dst.push_back( static_cast<char>( token ) );
+      if ( 15 <= numLiterals ) putLength( dst, numLiterals - 15 );
+      dst.insert( dst.end(), literals, literals + numLiterals );
+      if ( 0 == matchLen ) return;
+      dst.push_back( static_cast<char>( offset & 0xff ) );
+      dst.push_back( static_cast<char>( offset >> 8 ) );
+      if ( 15 <= m ) putLength( dst, m - 15 );
+    }
+  }
+
+  // Compress @param len bytes at @param src, appending to @param dst.
+  inline void lzCompress( const char *src, size_t len, std::vector<char> &dst )
+  {
+    const size_t none = static_cast<size_t>( -1 );
+    std::vector<size_t> table( 1 << lz::HASH_BITS, none );
+    size_t anchor = 0;
+    size_t i = 0;
+    while ( i + lz::MIN_MATCH <= len ) {
+      uint32_t seq = lz::read32( src + i );
+      uint32_t h = ( seq * 2654435761u ) >> ( 32 - lz::HASH_BITS );
+      size_t cand = table[h];
+      table[h] = i;
+      if ( none != cand && i - cand <= lz::MAX_OFFSET && lz::read32( src + cand ) == seq ) {
+        size_t m = lz::MIN_MATCH;
+        while ( i + m < len && src[cand + m] == src[i + m] ) m++;
+        lz::putSequence( dst, src + anchor, i - anchor, i - cand, m );
+        i += m;
+        anchor = i;
+      } else {
+        i++;
+      }
+    }
+    lz::putSequence( dst, src + anchor, len - anchor, 0, 0 );
+  }
+
+  // Decompress the block of @param len bytes at @param src, which must
+  // expand to exactly @param rawLen bytes, into @param dst. Returns
+  // false if the block is malformed.
+  //
+  // No input byte expands to more than 255 output bytes (a length
+  // extension byte of a match), so a @param rawLen beyond 255 times
+  // @param len is rejected before any memory is reserved for it.
+  inline bool lzDecompress( const char *src, size_t len, std::vector<char> &dst, size_t rawLen )
+  {
+    if ( rawLen / 255 > len ) return false;
+    dst.resize( rawLen );
+    const char *ip = src;
+    const char *end = src + len;
+    size_t op = 0;
+    while ( ip < end ) {
+      unsigned char token = static_cast<unsigned char>( *ip++ );
+      size_t numLiterals = token >> 4;
+      if ( 15 == numLiterals && !lz::getLength( ip, end, numLiterals ) ) return false;
+      if ( static_cast<size_t>( end - ip ) < numLiterals || rawLen - op < numLiterals ) return false;
+      if ( 0 < numLiterals ) memcpy( dst.data() + op, ip, numLiterals );
+      ip += numLiterals;
+      op += numLiterals;
+      if ( ip == end ) break;
+      
+      if ( end - ip < 2 ) return false;
+      size_t offset = static_cast<unsigned char>( ip[0] ) | ( static_cast<size_t>( static_cast<unsigned char>( ip[1] ) ) << 8 );
+      ip += 2;
+      size_t matchLen = token & 15;
+      if ( 15 == matchLen && !lz::getLength( ip, end, matchLen ) ) return false;
+      matchLen += lz::MIN_MATCH;
+      if ( 0 == offset || offset > op || rawLen - op < matchLen ) return false;
+      // byte by byte, as the match may overlap its own output
+      for ( size_t k=0; k<matchLen; k++, op++ ) {
+        dst[op] = dst[op - offset];
+      }
+    }
+    return op == rawLen;
+  }
+}
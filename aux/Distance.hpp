@@ -0,0 +1,172 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+// 
+// This file implements the distance kernels on raw feature rows that
+// are used in the hot loops of the library. The loops are written
+// over plain pointers with an explicit SIMD reduction, so that the
+// compiler vectorizes them even without -ffast-math, except for the
+// ordered kernels used by the splitters, which keep the summation
+// order of the stored thresholds and are vectorized across rows
+// instead.
+//
+// Each kernel takes the dimension as a template argument (0 for a
+// runtime dimension), and is dispatched on the runtime dimension once
+// per call, so that the common descriptor sizes run fully unrolled
+// fixed width code while any other size falls back to the loop.
+
+
+#pragma once
+
+#include <cmath>
+#include <type_traits>
+
+namespace ran_forest
+{
+  // The type in which distances over dataType elements are
+  // accumulated. Everything but double is accumulated in float, which
+  // keeps the SIMD lanes as wide as possible.
+  template <typename dataType>
+  struct Accumulator
+  {
+    typedef typename std::conditional<std::is_same<dataType, double>::value,
+                                      double, float>::type type;
+  };
+
+  // The dimensions for which the dispatchers below pick a kernel with
+  // a compile-time trip count. Other dimensions use the runtime one.
+  // Define it before including the library to change the list.
+#ifndef RANFOREST_FIXED_DIMS
+#define RANFOREST_FIXED_DIMS( CASE ) CASE( 32 ) CASE( 64 ) CASE( 128 ) CASE( 256 )
+#endif
+
+  // L1 distance between two rows, over @tparam fixedDim dimensions if
+  // it is positive (a fully unrolled, fixed width loop), and over
+  // @param dim dimensions otherwise.
+  template <int fixedDim, typename dataType>
+  inline typename Accumulator<dataType>::type distL1N( const dataType *a, const dataType *b, int dim )
+  {
+    typedef typename Accumulator<dataType>::type acc_t;
+    const int n = 0 < fixedDim ? fixedDim : dim;
+    acc_t s = 0;
+#   pragma omp simd reduction(+ : s)
+    for ( int j=0; j<n; j++ ) {
+      s += std::fabs( static_cast<acc_t>( a[j] ) - static_cast<acc_t>( b[j] ) );
+    }
+    return s;
+  }
+
+  // L1 distance between two @param dim dimensional rows.
+  template <typename dataType>
+  inline typename Accumulator<dataType>::type distL1( const dataType *a, const dataType *b, int dim )
+  {
+#   define RANFOREST_CASE( D ) case D: return distL1N<D>( a, b, dim );
+    switch ( dim ) {
+      RANFOREST_FIXED_DIMS( RANFOREST_CASE )
+    default: return distL1N<0>( a, b, dim );
+    }
+#   undef RANFOREST_CASE
+  }
+
+  // Squared L2 distance between two rows, over @tparam fixedDim (if
+  // positive) or @param dim dimensions.
+  template <int fixedDim, typename dataType>
+  inline typename Accumulator<dataType>::type distL2SqN( const dataType *a, const dataType *b, int dim )
+  {
+    typedef typename Accumulator<dataType>::type acc_t;
+    const int n = 0 < fixedDim ? fixedDim : dim;
+    acc_t s = 0;
+#   pragma omp simd reduction(+ : s)
+    for ( int j=0; j<n; j++ ) {
+      acc_t tmp = static_cast<acc_t>( a[j] ) - static_cast<acc_t>( b[j] );
+      s += tmp * tmp;
+    }
+    return s;
+  }
+
+  // Squared L2 distance between two @param dim dimensional rows.
+  template <typename dataType>
+  inline typename Accumulator<dataType>::type distL2Sq( const dataType *a, const dataType *b, int dim )
+  {
+#   define RANFOREST_CASE( D ) case D: return distL2SqN<D>( a, b, dim );
+    switch ( dim ) {
+      RANFOREST_FIXED_DIMS( RANFOREST_CASE )
+    default: return distL2SqN<0>( a, b, dim );
+    }
+#   undef RANFOREST_CASE
+  }
+
+  // L1 distance accumulated in double, one dimension after another in
+  // their order, over @tparam fixedDim (if positive) or @param dim
+  // dimensions. This is the order algebra::dist_l1() sums in, with
+  // which the thresholds of every tree grown so far were computed, so
+  // the splitters route with it. Only the trip count is specialized,
+  // as a SIMD reduction over the dimensions would reorder the sum (see
+  // distL1OrderedMany() for the vectorized form).
+  template <int fixedDim, typename dataType>
+  inline double distL1OrderedN( const dataType *a, const dataType *b, int dim )
+  {
+    const int n = 0 < fixedDim ? fixedDim : dim;
+    double s = 0.0;
+    for ( int j=0; j<n; j++ ) {
+      s += std::fabs( static_cast<double>( a[j] ) - static_cast<double>( b[j] ) );
+    }
+    return s;
+  }
+
+  template <typename dataType>
+  inline double distL1Ordered( const dataType *a, const dataType *b, int dim )
+  {
+#   define RANFOREST_CASE( D ) case D: return distL1OrderedN<D>( a, b, dim );
+    switch ( dim ) {
+      RANFOREST_FIXED_DIMS( RANFOREST_CASE )
+    default: return distL1OrderedN<0>( a, b, dim );
+    }
+#   undef RANFOREST_CASE
+  }
+
+  // The number of rows distL1OrderedMany() takes at a time, one per
+  // SIMD lane (two AVX-512 or four AVX registers of doubles).
+  const int ORDERED_BLOCK = 8;
+
+  // The distances from the row @param a to each of the @param n rows
+  // @param rows, written to @param out, over @tparam fixedDim (if
+  // positive) or @param dim dimensions. The rows are taken
+  // ORDERED_BLOCK at a time with the loop over the block innermost, so
+  // that the SIMD lanes hold different rows, and every distance is
+  // summed in the very order of distL1OrderedN().
+  template <int fixedDim, typename dataType>
+  inline void distL1OrderedManyN( const dataType *a, const dataType* const *rows, size_t n, int dim,
+                                  double *out )
+  {
+    const int m = 0 < fixedDim ? fixedDim : dim;
+    size_t i = 0;
+    for ( ; i + ORDERED_BLOCK <= n; i += ORDERED_BLOCK ) {
+      const dataType* const *r = rows + i;
+      double s[ORDERED_BLOCK];
+      for ( int l=0; l<ORDERED_BLOCK; l++ ) s[l] = 0.0;
+      for ( int j=0; j<m; j++ ) {
+        double aj = static_cast<double>( a[j] );
+#       pragma omp simd
+        for ( int l=0; l<ORDERED_BLOCK; l++ ) {
+          s[l] += std::fabs( aj - static_cast<double>( r[l][j] ) );
+        }
+      }
+      for ( int l=0; l<ORDERED_BLOCK; l++ ) out[i + l] = s[l];
+    }
+    for ( size_t l=0; i + l<n; l++ ) out[i + l] = distL1OrderedN<fixedDim>( a, rows[i + l], dim );
+  }
+
+  template <typename dataType>
+  inline void distL1OrderedMany( const dataType *a, const dataType* const *rows, size_t n, int dim,
+                                 double *out )
+  {
+#   define RANFOREST_CASE( D ) case D: distL1OrderedManyN<D>( a, rows, n, dim, out ); return;
+    switch ( dim ) {
+      RANFOREST_FIXED_DIMS( RANFOREST_CASE )
+    default: distL1OrderedManyN<0>( a, rows, n, dim, out );
+    }
+#   undef RANFOREST_CASE
+  }
+}
@@ -0,0 +1,83 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+// 
+// This file implements class RandomStream, a small PCG32 random
+// number generator (M.E. O'Neill, "PCG: A Family of Simple Fast
+// Space-Efficient Statistically Good Algorithms for Random Number
+// Generation"). A stream is fully determined by a (seed, stream ID)
+// pair, and different stream IDs under the same seed give
+// independent sequences. The forest hands one stream to every tree
+// it grows, so that growth never touches shared generator state and
+// the result does not depend on the number of threads.
+
+
+#pragma once
+
+#include <cstdint>
+
+namespace ran_forest
+{
+  class RandomStream
+  {
+  private:
+    uint64_t state;
+    uint64_t inc;
+
+  public:
+    explicit RandomStream( uint64_t seed = 0, uint64_t stream = 0 )
+    {
+      reset( seed, stream );
+    }
+
+    inline void reset( uint64_t seed, uint64_t stream )
+    {
+      state = 0;
+      inc = ( stream << 1 ) | 1;
+      next();
+      state += seed;
+      next();
+    }
+
+    // a uniformly distributed 32 bit integer
+    inline uint32_t next()
+    {
+      uint64_t old = state;
+      state = old * 6364136223846793005ULL + inc;
+      uint32_t xorshifted = static_cast<uint32_t>( ( ( old >> 18 ) ^ old ) >> 27 );
+      uint32_t rot = static_cast<uint32_t>( old >> 59 );
+      return ( xorshifted >> rot ) | ( xorshifted << ( ( -rot ) & 31 ) );
+    }
+
+    inline uint64_t next64()
+    {
+      uint64_t hi = next();
+      return ( hi << 32 ) | next();
+    }
+
+    // a uniformly distributed integer in [0, n), without modulo bias
+    inline uint64_t uniform( uint64_t n )
+    {
+      if ( n <= 0xffffffffULL ) {
+        uint32_t bound = static_cast<uint32_t>( n );
+        uint32_t threshold = ( -bound ) % bound;
+        for (;;) {
+          uint32_t r = next();
+          if ( r >= threshold ) return r % bound;
+        }
+      }
+      uint64_t threshold = ( -n ) % n;
+      for (;;) {
+        uint64_t r = next64();
+        if ( r >= threshold ) return r % n;
+      }
+    }
+
+    // a uniformly distributed real number in [0, 1)
+    inline double real()
+    {
+      return ( next64() >> 11 ) * ( 1.0 / 9007199254740992.0 );
+    }
+  };
+}
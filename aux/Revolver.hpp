@@ -11,7 +11,9 @@
 
 #include <cstdlib>
 #include <vector>
+#include <unordered_map>
 #include <limits.h>
+#include "Random.hpp"
 
 using std::vector;
 
@@ -26,31 +28,89 @@ namespace ran_forest {
     vector<int> pool;
     int curPos;
     // pool[address] = id
+    RandomStream rng;
+    // A pool reset to 0 .. n-1 is kept implicit: only the addresses
+    // whose id differs from the address are stored in displaced, so
+    // that resetting is O(1) and drawing k samples is O(k). Once more
+    // than 1 / DENSE_RATIO of the pool would be displaced, the pool is
+    // written out in full, as a hash lookup per element then costs more
+    // time and memory than the dense array.
+    enum : int { DENSE_RATIO = 8 };
+    bool identity;
+    std::unordered_map<int,int> displaced;
+
+    // leave the implicit mode, writing out the first size addresses
+    inline void densify()
+    {
+      if ( !identity ) return;
+      pool.resize( size );
+      for ( int i=0; i<size; i++ ) pool[i] = i;
+      for ( auto& ele : displaced ) {
+        if ( ele.first < size ) pool[ele.first] = ele.second;
+      }
+      identity = false;
+      std::unordered_map<int,int>().swap( displaced );
+    }
+
+    inline int get( int add ) const
+    {
+      if ( !identity ) return pool[add];
+      auto it = displaced.find( add );
+      return displaced.end() == it ? add : it->second;
+    }
+
+    inline void set( int add, int id )
+    {
+      if ( !identity ) {
+        pool[add] = id;
+      } else if ( add == id ) {
+        displaced.erase( add );
+      } else {
+        displaced[add] = id;
+        if ( static_cast<int>( displaced.size() ) * DENSE_RATIO > size ) densify();
+      }
+    }
+
+    inline void swap( int a, int b )
+    {
+      int t = get( a );
+      set( a, get( b ) );
+      set( b, t );
+    }
+    
   public:
 
     inline Shuffler()
     {
       size = 0;
       pool.clear();
+      identity = false;
     }
   
     inline Shuffler( const vector<int> &init ) 
     {
-      pool.clear();
-      size = init.size();
-      for ( auto& ele : init ) {
-        pool.push_back( ele );
-      }
+      Reset( init );
     }
 
     inline Shuffler( Shuffler &&other ) 
     {
       size = other.size;
       pool.swap( other.pool );
+      rng = other.rng;
+      identity = other.identity;
+      displaced.swap( other.displaced );
+    }
+
+    // Restart the random stream with the given seed and stream ID
+    inline void Seed( uint64_t seed, uint64_t stream = 0 )
+    {
+      rng.reset( seed, stream );
     }
 
     inline void Reset( const vector<int> &init ) 
     {
+      identity = false;
+      displaced.clear();
       pool.clear();
       size = init.size();
       for ( auto& ele : init ) {
@@ -62,37 +122,28 @@ namespace ran_forest {
     inline void Reset( int n )
     {
       size = n;
-      pool.resize( n );
-      for ( int i=0; i<n; i++ ) {
-        pool[i] = i;
-      }
+      pool.clear();
+      identity = true;
+      displaced.clear();
     }
   
     inline Shuffler( int n ) 
     {
-      size = n;
-      pool.resize( n );
-      for ( int i=0; i<n; i++ ) {
-        pool[i] = i;
-      }
+      Reset( n );
     }
 
     inline Shuffler( const Shuffler &sfl ) 
     {
-      size = sfl.size;
-      pool.resize( sfl.size );
-      for ( int i=0; i<sfl.size; i++ ) {
-        pool[i] = sfl(i);
-      }
+      *this = sfl;
     }
 
     inline void operator=( const Shuffler &sfl )
     {
+      rng = sfl.rng;
       size = sfl.size;
-      pool.resize( sfl.size );
-      for ( int i=0; i<sfl.size; i++ ) {
-        pool[i] = sfl(i);
-      }
+      pool = sfl.pool;
+      identity = sfl.identity;
+      displaced = sfl.displaced;
     }
   
     inline int Number() const
@@ -105,9 +156,9 @@ namespace ran_forest {
     inline void SpliceID( int id )
     {
       for ( int i=0; i<size-1; i++ ) {
-        if ( id == pool[i] ) {
-          pool[i] = pool[size-1];
-          pool[size-1] = id;
+        if ( id == get( i ) ) {
+          set( i, get( size-1 ) );
+          set( size-1, id );
           break;
         }
       }
@@ -118,30 +169,23 @@ namespace ran_forest {
     // no looking up involved
     inline void SpliceAddress( int add )
     {
-      int t = pool[add];
-      pool[add] = pool[size-1];
-      pool[size-1] = t;
+      swap( add, size-1 );
       size--;
     }
   
     inline void Shuffle( int k ) 
     {
+      // drawing a large part of the pool displaces as many addresses
+      if ( static_cast<long>( k ) * DENSE_RATIO > size ) densify();
       for ( int i=0, end= k < size ? k : size; i < end; i++  ) {
-        int r = rand() % (size-i) + i;
-        int t = pool[r];
-        pool[r] = pool[i];
-        pool[i] = t;
+        int r = static_cast<int>( rng.uniform( size-i ) ) + i;
+        swap( r, i );
       }
     }
 
     inline void Shuffle() 
     {
-      for ( int i=0; i<size; i++  ) {
-        int r = rand() % (size-i) + i;
-        int t = pool[r];
-        pool[r] = pool[i];
-        pool[i] = t;
-      }
+      Shuffle( size );
     }
 
     inline void Keep( int k ) {
@@ -161,11 +205,9 @@ namespace ran_forest {
     {
       curPos++;
       if ( curPos >= size ) return SHUFFLER_ERROR; // Out of bound
-      int r = rand() % (size-curPos) + curPos;
-      int t = pool[r];
-      pool[r] = pool[curPos];
-      pool[curPos] = t;
-      return t;
+      int r = static_cast<int>( rng.uniform( size-curPos ) ) + curPos;
+      swap( r, curPos );
+      return get( curPos );
     }
 
     // - Delete sample at current position
@@ -180,14 +222,14 @@ namespace ran_forest {
 
     inline int operator() ( int add ) const
     {
-      return pool[add];
+      return get( add );
     }
 
     inline void show() const
     {
       printf( "( " );
       for ( int i=0; i<size; i++ ) {
-        printf( "%u ", pool[i] );
+        printf( "%u ", get( i ) );
       }
       printf( ") size = %u\n", size );
     }
@@ -196,5 +238,3 @@ namespace ran_forest {
   };
 
 }
-
-
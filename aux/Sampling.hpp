@@ -0,0 +1,154 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+// 
+// This file implements sampling without replacement from [0, n),
+// driven by a RandomStream (see aux/Random.hpp):
+//
+// - randperm() draws k distinct integers. When k is small compared
+//   with n it uses Floyd's algorithm, which takes O(k) time and
+//   memory regardless of n, and a partial Fisher-Yates shuffle
+//   otherwise.
+//
+// - SequentialSampler emits k distinct integers in ascending order,
+//   one at a time, with O(1) memory (Knuth's Algorithm S). It is
+//   meant for bootstrap samples that are a large fraction of the
+//   data, and that are to be scanned sequentially afterwards.
+//
+// - sortedSample() collects the output of either of the above into a
+//   sorted vector, picking the cheaper one.
+
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <unordered_set>
+#include "Random.hpp"
+
+namespace ran_forest
+{
+  // Floyd's algorithm: min(@param k, @param n) distinct integers
+  // from [0, @param n), written to @param re. Each of them is equally
+  // likely to be in the sample, but the order of the output is not
+  // uniformly random.
+  inline void sampleFloyd( RandomStream &rng, size_t n, size_t k, std::vector<size_t> &re )
+  {
+    if ( k > n ) k = n;
+    re.clear();
+    re.reserve( k );
+    if ( k <= 64 ) {
+      // a linear scan beats hashing for the handful of hypotheses a
+      // node usually draws
+      for ( size_t j=n-k; j<n; j++ ) {
+        size_t t = static_cast<size_t>( rng.uniform( j + 1 ) );
+        if ( std::find( re.begin(), re.end(), t ) == re.end() ) {
+          re.push_back( t );
+        } else {
+          re.push_back( j );
+        }
+      }
+      return;
+    }
+    std::unordered_set<size_t> taken( k * 2 );
+    for ( size_t j=n-k; j<n; j++ ) {
+      size_t t = static_cast<size_t>( rng.uniform( j + 1 ) );
+      if ( !taken.insert( t ).second ) {
+        taken.insert( j );
+        t = j;
+      }
+      re.push_back( t );
+    }
+  }
+
+  inline std::vector<size_t> sampleFloyd( RandomStream &rng, size_t n, size_t k )
+  {
+    std::vector<size_t> re;
+    sampleFloyd( rng, n, k, re );
+    return re;
+  }
+
+  // Write min(@param k, @param n) distinct integers drawn uniformly
+  // from [0, @param n) to @param perm. Callers drawing many samples
+  // can pass the same perm to reuse its capacity.
+  inline void randperm( RandomStream &rng, size_t n, size_t k, std::vector<size_t> &perm )
+  {
+    if ( k > n ) k = n;
+    if ( k * 16 < n ) {
+      sampleFloyd( rng, n, k, perm );
+      return;
+    }
+    perm.resize( n );
+    for ( size_t i=0; i<n; i++ ) perm[i] = i;
+    for ( size_t i=0; i<k; i++ ) {
+      size_t r = i + static_cast<size_t>( rng.uniform( n - i ) );
+      std::swap( perm[i], perm[r] );
+    }
+    perm.resize( k );
+  }
+
+  // Return min(@param k, @param n) distinct integers drawn uniformly
+  // from [0, @param n).
+  inline std::vector<size_t> randperm( RandomStream &rng, size_t n, size_t k )
+  {
+    std::vector<size_t> perm;
+    randperm( rng, n, k, perm );
+    return perm;
+  }
+
+  // Emits min(@param k, @param n) distinct integers from [0, @param
+  // n) in ascending order. Every k-subset is equally likely.
+  class SequentialSampler
+  {
+  private:
+    RandomStream &rng;
+    size_t n;
+    size_t k;
+    // the next candidate to consider
+    size_t cur;
+    
+  public:
+    SequentialSampler( RandomStream &rng, size_t n, size_t k )
+      : rng(rng), n(n), k( k < n ? k : n ), cur(0) {}
+
+    // the number of integers still to be emitted
+    inline size_t remain() const
+    {
+      return k;
+    }
+
+    // Return the next integer of the sample, or n once the whole
+    // sample has been emitted.
+    inline size_t next()
+    {
+      while ( 0 < k ) {
+        // select cur with probability k / (n - cur)
+        if ( rng.uniform( n - cur ) < k ) {
+          k--;
+          return cur++;
+        }
+        cur++;
+      }
+      return n;
+    }
+  };
+
+  // Return min(@param k, @param n) distinct integers drawn uniformly
+  // from [0, @param n), sorted in ascending order.
+  inline std::vector<size_t> sortedSample( RandomStream &rng, size_t n, size_t k )
+  {
+    if ( k > n ) k = n;
+    if ( k * 16 < n ) {
+      std::vector<size_t> re = sampleFloyd( rng, n, k );
+      std::sort( re.begin(), re.end() );
+      return re;
+    }
+    std::vector<size_t> re( k );
+    SequentialSampler sampler( rng, n, k );
+    for ( size_t i=0; i<k; i++ ) {
+      re[i] = sampler.next();
+    }
+    return re;
+  }
+}
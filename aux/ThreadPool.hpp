@@ -0,0 +1,107 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+// 
+// This file implements class ThreadPool, a fixed set of persistent
+// worker threads consuming a shared job queue. Unlike an OpenMP
+// parallel region, the workers are created once and stay alive until
+// the pool is destroyed, so that many small batches of jobs can be
+// served without paying the fork/join cost on every batch.
+
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace ran_forest
+{
+  class ThreadPool
+  {
+  private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > jobs;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    bool stopping;
+
+    // the loop of each worker, which returns only when the pool is
+    // stopping and no job is left in the queue
+    void work()
+    {
+      for (;;) {
+        std::function<void()> job;
+        {
+          std::unique_lock<std::mutex> guard( lock );
+          wakeup.wait( guard, [this]() { return stopping || !jobs.empty(); } );
+          if ( jobs.empty() ) return;
+          job = std::move( jobs.front() );
+          jobs.pop_front();
+        }
+        job();
+      }
+    }
+
+  public:
+    // Create a pool of @param numThreads workers. A non-positive
+    // value means one worker per hardware thread.
+    explicit ThreadPool( int numThreads = 0 ) : workers(), jobs(), stopping(false)
+    {
+      if ( numThreads <= 0 ) {
+        numThreads = static_cast<int>( std::thread::hardware_concurrency() );
+      }
+      if ( numThreads <= 0 ) numThreads = 1;
+      for ( int i=0; i<numThreads; i++ ) {
+        workers.emplace_back( &ThreadPool::work, this );
+      }
+    }
+
+    ThreadPool( const ThreadPool& ) = delete;
+    ThreadPool& operator=( const ThreadPool& ) = delete;
+
+    // pending jobs are finished before the workers are joined
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> guard( lock );
+        stopping = true;
+      }
+      wakeup.notify_all();
+      for ( auto& worker : workers ) {
+        worker.join();
+      }
+    }
+
+    inline void run( std::function<void()> job )
+    {
+      {
+        std::lock_guard<std::mutex> guard( lock );
+        jobs.push_back( std::move( job ) );
+      }
+      wakeup.notify_one();
+    }
+
+    // Enqueue a whole batch of jobs with a single lock acquisition.
+    inline void run( std::vector<std::function<void()> > &batch )
+    {
+      {
+        std::lock_guard<std::mutex> guard( lock );
+        for ( auto& job : batch ) {
+          jobs.push_back( std::move( job ) );
+        }
+      }
+      batch.clear();
+      wakeup.notify_all();
+    }
+
+    inline int size() const
+    {
+      return static_cast<int>( workers.size() );
+    }
+  };
+}
@@ -0,0 +1,198 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+//
+// This file implements the message passing used to train a forest
+// across several processes (see Forest::growShard() and
+// Forest::gather()).
+//
+// Transport is the interface: the processes of a job are numbered
+// 0, ..., size() - 1 (their ranks), and any of them can send a message
+// (a byte buffer) to any other. Messages between the same pair of
+// ranks arrive in the order they were sent. An implementation over
+// MPI or a cluster's own RPC layer only needs to provide these four
+// functions.
+//
+// SocketTransport is the implementation for a single machine, where
+// the ranks are processes forked by runLocal() and every pair of them
+// is connected by a Unix domain socket pair.
+
+
+#pragma once
+
+#include <cstdint>
+#include <cerrno>
+#include <vector>
+#include <functional>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+namespace ran_forest
+{
+  class Transport
+  {
+  public:
+    virtual ~Transport() {}
+
+    virtual int rank() const = 0;
+    virtual int size() const = 0;
+
+    // Send @param message to rank @param to. Returns false on failure.
+    virtual bool send( int to, const std::vector<char> &message ) = 0;
+
+    // Receive the next message from rank @param from into @param
+    // message, blocking until it arrives. Returns false on failure.
+    virtual bool recv( int from, std::vector<char> &message ) = 0;
+  };
+
+
+  class SocketTransport : public Transport
+  {
+  private:
+    int me;
+    // fds[r] is the socket connected to rank r (-1 for itself)
+    std::vector<int> fds;
+
+  public:
+    SocketTransport( int rank, std::vector<int> sockets ) : me( rank ), fds( sockets ) {}
+
+    ~SocketTransport()
+    {
+      for ( auto& fd : fds ) {
+        if ( 0 <= fd ) close( fd );
+      }
+    }
+
+    int rank() const
+    {
+      return me;
+    }
+
+    int size() const
+    {
+      return static_cast<int>( fds.size() );
+    }
+
+    // A message is its length (uint64_t) followed by its contents.
+    bool send( int to, const std::vector<char> &message )
+    {
+      uint64_t len = message.size();
+      return transfer( fds[to], reinterpret_cast<char*>( &len ), sizeof(uint64_t), true ) &&
+        transfer( fds[to], const_cast<char*>( message.data() ), message.size(), true );
+    }
+
+    bool recv( int from, std::vector<char> &message )
+    {
+      uint64_t len = 0;
+      if ( !transfer( fds[from], reinterpret_cast<char*>( &len ), sizeof(uint64_t), false ) ) {
+        return false;
+      }
+      message.resize( len );
+      return transfer( fds[from], message.data(), message.size(), false );
+    }
+
+  private:
+    // write (or read) exactly @param len bytes
+    static bool transfer( int fd, char *buf, size_t len, bool out )
+    {
+      while ( 0 < len ) {
+        ssize_t n = out ? write( fd, buf, len ) : read( fd, buf, len );
+        if ( n < 0 && EINTR == errno ) continue;
+        if ( n <= 0 ) return false;
+        buf += n;
+        len -= static_cast<size_t>( n );
+      }
+      return true;
+    }
+  };
+
+
+  // Run @param job on @param size local processes connected by a
+  // SocketTransport. The calling process becomes rank 0, and ranks 1,
+  // ..., size - 1 are forked from it, so they start with a copy of
+  // everything it holds (e.g. the data set). Returns 0 if every rank
+  // returned 0 from the job, and -1 otherwise.
+  //
+  // Fork before the calling process starts any OpenMP parallel region
+  // of its own, as not every OpenMP runtime survives a fork once its
+  // thread pool is up.
+  //
+  // If the sockets cannot be created or a fork fails, the ranks
+  // already forked are killed and reaped, the sockets are closed, and
+  // -1 is returned without running the job.
+  inline int runLocal( int size, std::function<int(Transport&)> job )
+  {
+    std::vector<std::vector<int> > fds( size, std::vector<int>( size, -1 ) );
+    auto closeAll = [&fds]()
+      {
+        for ( auto& row : fds ) {
+          for ( auto& fd : row ) {
+            if ( 0 <= fd ) close( fd );
+          }
+        }
+      };
+    for ( int i=0; i<size; i++ ) {
+      for ( int j=i+1; j<size; j++ ) {
+        int pair[2];
+        if ( 0 != socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) ) {
+          closeAll();
+          return -1;
+        }
+        fds[i][j] = pair[0];
+        fds[j][i] = pair[1];
+      }
+    }
+
+    // keep only the sockets of rank @param r open
+    auto keep = [&fds, size]( int r )
+      {
+        for ( int i=0; i<size; i++ ) {
+          if ( i == r ) continue;
+          for ( int j=0; j<size; j++ ) {
+            if ( 0 <= fds[i][j] ) close( fds[i][j] );
+          }
+        }
+      };
+
+    std::vector<pid_t> children;
+    for ( int r=1; r<size; r++ ) {
+      pid_t pid = fork();
+      if ( 0 == pid ) {
+        keep( r );
+        int code = 0;
+        {
+          SocketTransport transport( r, fds[r] );
+          code = job( transport );
+        }
+        _exit( 0 == code ? 0 : 1 );
+      }
+      if ( pid < 0 ) {
+        for ( auto& child : children ) kill( child, SIGKILL );
+        for ( auto& child : children ) {
+          while ( 0 > waitpid( child, nullptr, 0 ) && EINTR == errno ) {}
+        }
+        closeAll();
+        return -1;
+      }
+      children.push_back( pid );
+    }
+
+    keep( 0 );
+    int code = 0;
+    {
+      SocketTransport transport( 0, fds[0] );
+      code = job( transport );
+    }
+    for ( auto& pid : children ) {
+      int status = 0;
+      if ( pid != waitpid( pid, &status, 0 ) || !WIFEXITED( status ) || 0 != WEXITSTATUS( status ) ) {
+        code = -1;
+      }
+    }
+    return 0 == code ? 0 : -1;
+  }
+}
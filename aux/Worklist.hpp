@@ -0,0 +1,118 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+//
+// This file implements class Worklist, the double ended queue of the
+// nodes waiting to be split while a tree grows.
+//
+// A Worklist is a ring buffer that doubles when it is full and never
+// shrinks. std::deque, which it replaces, frees a block whenever an
+// end is popped past a block boundary and allocates it again on the
+// next push, so a depth first growth hovering around a boundary paid
+// an allocation for every other split. A Worklist allocates only while
+// it reaches a new maximum length, a few times per tree.
+//
+// Only move construction is required of the elements, as the kernel
+// states (see kernels/VP.hpp) cannot be assigned.
+
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace ran_forest
+{
+  template <typename T>
+  class Worklist
+  {
+  private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+    enum : size_t { FIRST_CAPACITY = 16 };
+
+    // the count elements are in slots head, head + 1, ..., wrapping
+    // around at capacity, which is 0 or a power of 2
+    std::unique_ptr<Slot[]> slots;
+    size_t capacity;
+    size_t head;
+    size_t count;
+
+    inline T* at( size_t i )
+    {
+      return reinterpret_cast<T*>( &slots[( head + i ) & ( capacity - 1 )] );
+    }
+
+    void grow()
+    {
+      size_t newCapacity = 0 == capacity ? static_cast<size_t>( FIRST_CAPACITY ) : capacity * 2;
+      std::unique_ptr<Slot[]> newSlots( new Slot[newCapacity] );
+      for ( size_t i=0; i<count; i++ ) {
+        T *p = at( i );
+        new ( &newSlots[i] ) T( std::move( *p ) );
+        p->~T();
+      }
+      slots.swap( newSlots );
+      capacity = newCapacity;
+      head = 0;
+    }
+
+  public:
+    typedef T value_type;
+
+    Worklist() : slots(), capacity(0), head(0), count(0) {}
+
+    Worklist( const Worklist& other ) = delete;
+    Worklist& operator=( const Worklist& other ) = delete;
+
+    ~Worklist()
+    {
+      while ( 0 < count ) pop_back();
+    }
+
+    template <typename... Args>
+    inline void emplace_back( Args&&... args )
+    {
+      if ( count == capacity ) grow();
+      new ( at( count ) ) T( std::forward<Args>( args )... );
+      count++;
+    }
+
+    inline T& front()
+    {
+      return *at( 0 );
+    }
+
+    inline T& back()
+    {
+      return *at( count - 1 );
+    }
+
+    inline void pop_front()
+    {
+      at( 0 )->~T();
+      head = ( head + 1 ) & ( capacity - 1 );
+      count--;
+    }
+
+    inline void pop_back()
+    {
+      at( count - 1 )->~T();
+      count--;
+    }
+
+    inline bool empty() const
+    {
+      return 0 == count;
+    }
+
+    inline size_t size() const
+    {
+      return count;
+    }
+  };
+}
@@ -18,6 +18,14 @@
 //    top K nearest centers (clusters) among all the associated
 //    centers in the original graph, and each center (cluster) will be
 //    updated as the mean of all associated data points.
+//
+// The graph usually comes from Forest::batchQuery(), whose columns are
+// all the node IDs of the forest, most of which (the internal nodes)
+// have no data point. Compact() relabels such a graph so that only its
+// non-empty columns become centers, and can merge the leaves holding
+// too few data points into their ancestors, so that the centers and
+// the cost of each iteration scale with the clusters that are actually
+// populated.
 
 
 
@@ -26,7 +34,10 @@
 
 #include <vector>
 #include <memory>
+#include <limits>
+#include <algorithm>
 #include "../RanForest.hpp"
+#include "../aux/Distance.hpp"
 #include "LLPack/algorithms/heap.hpp"
 
 
@@ -45,6 +56,13 @@ namespace ran_forest {
     // the centers of the resulting clusters
     std::vector<std::vector<dataType> > centers;
 
+    // Set by Compact(): the column of the original graph (the node ID
+    // for a graph from the forest) each center started from, and the
+    // center each column of the original graph was assigned to
+    // (NULL_NODE for empty columns).
+    std::vector<size_t> origin;
+    std::vector<size_t> centerOf;
+
     struct Options
     {
       // the maximum number of iterations
@@ -67,7 +85,7 @@ namespace ran_forest {
       Options() : maxIter(20), replicate(10), converge(1e-5), wtBandwidth(100.0) {}
     } options;
 
-    TMeanShell( int dimension ) : dim(dimension), centers(), options() {}
+    TMeanShell( int dimension ) : dim(dimension), centers(), origin(), centerOf(), options() {}
 
 
     // +-------------------------------------------------------------------------------
@@ -92,7 +110,8 @@ namespace ran_forest {
 
   public:
 
-    
+    // The centers are followed by origin and centerOf, which the
+    // serving side needs to map node IDs to centers after Compact().
     void write( std::string filename )
     {
       WITH_OPEN( out, filename.c_str(), "wb" );
@@ -101,11 +120,15 @@ namespace ran_forest {
       for ( auto& ele : centers ) {
         fwrite( &ele[0], sizeof(dataType), dim, out );
       }
+      writeVector( out, origin );
+      writeVector( out, centerOf );
       seal( out );
       END_WITH( out );
     }
 
 
+    // Files written before origin and centerOf were saved end right
+    // after the centers, and leave both empty.
     void read( std::string filename )
     {
       WITH_OPEN( in, filename.c_str(), "rb" );
@@ -113,18 +136,162 @@ namespace ran_forest {
       fread( &len, sizeof(size_t), 1, in );
       centers.resize( len );
       for ( auto& ele : centers ) {
-        ele.size( dim );
+        ele.resize( dim );
         fread( &ele[0], sizeof(dataType), dim, in );
       }
+      origin.clear();
+      centerOf.clear();
+      long mark = ftell( in );
       if ( !unseal( in ) ) {
-        Error( "TMeanShell: unseal() failed, might be due to wrong centers data." );
-        exit( -1 );
+        fseek( in, mark, SEEK_SET );
+        readVector( in, origin );
+        readVector( in, centerOf );
+        if ( !unseal( in ) ) {
+          Error( "TMeanShell: unseal() failed, might be due to wrong centers data." );
+          exit( -1 );
+        }
+      }
+      for ( auto& l : centerOf ) {
+        if ( NULL_NODE != l && l >= centers.size() ) {
+          Error( "TMeanShell: centerOf refers to a center beyond the %lu read.", centers.size() );
+          exit( -1 );
+        }
       }
       END_WITH( in );
     }
 
+
+    // +-------------------------------------------------------------------------------
+    // Initialization
+  public:
+
+    // Relabel the columns of @param n_to_l so that each non-empty
+    // column becomes a center, numbered in the order of the columns,
+    // and the empty ones are dropped. Call it before Clustering().
+    void Compact( Bipartite& n_to_l )
+    {
+      size_t L = n_to_l.sizeB();
+      std::vector<size_t> owner( L, NULL_NODE );
+      for ( size_t l=0; l<L; l++ ) {
+        if ( !n_to_l.to( l ).empty() ) owner[l] = l;
+      }
+      relabel( n_to_l, owner );
+    }
+
+    // Same as Compact( n_to_l ), for the graph returned by
+    // @param forest.batchQuery(), whose columns are the node IDs of the
+    // forest. The data points of a leaf holding fewer than @param
+    // minSize of them are handed to its parent, and so on up the tree:
+    // a node becomes a center once the points handed to it reach
+    // minSize, and the root of a tree takes whatever is left. A
+    // minSize of 0 or 1 merges nothing.
+    template <typename forestType, template <typename> class kernel>
+    void Compact( Bipartite& n_to_l, const Forest<forestType, kernel>& forest, size_t minSize )
+    {
+      size_t L = n_to_l.sizeB();
+      if ( L != forest.numNodes() ) {
+        Error( "TMeanShell: the columns of the graph are not the nodes of the forest." );
+        exit( -1 );
+      }
+
+      // carry[i] is the number of data points node i hands to its
+      // parent, and owner[i] is i itself if it becomes a center
+      std::vector<size_t> carry( L, 0 );
+      std::vector<size_t> owner( L, NULL_NODE );
+      std::vector<std::pair<size_t, bool> > stack;
+      for ( int t=0; t<forest.numTrees(); t++ ) {
+        size_t root = forest.treeRoot( t );
+        // postorder, each node is pushed again (true) once its
+        // children are done
+        stack.emplace_back( root, false );
+        while ( !stack.empty() ) {
+          size_t i = stack.back().first;
+          bool done = stack.back().second;
+          stack.pop_back();
+          auto& children = forest.childrenView( i );
+          if ( !done && !children.empty() ) {
+            stack.emplace_back( i, true );
+            for ( auto& c : children ) stack.emplace_back( c, false );
+            continue;
+          }
+          size_t mass = n_to_l.to( i ).size();
+          for ( auto& c : children ) mass += carry[c];
+          if ( 0 < mass && ( minSize <= mass || root == i ) ) {
+            owner[i] = i;
+          } else {
+            carry[i] = mass;
+          }
+        }
+
+        // preorder, the points carried up by a node go to the nearest
+        // center above it
+        std::vector<std::pair<size_t, size_t> > down( 1, std::make_pair( root, NULL_NODE ) );
+        while ( !down.empty() ) {
+          size_t i = down.back().first;
+          size_t above = down.back().second;
+          down.pop_back();
+          if ( NULL_NODE != owner[i] ) {
+            above = i;
+          } else if ( 0 < carry[i] ) {
+            owner[i] = above;
+          }
+          for ( auto& c : forest.childrenView( i ) ) down.emplace_back( c, above );
+        }
+      }
+
+      relabel( n_to_l, owner );
+    }
+
+  private:
+
+    // Replace @param n_to_l by the graph whose columns are the distinct
+    // values of @param owner, in ascending order, where every edge to
+    // column l is moved to column owner[l]. Also sets origin and
+    // centerOf.
+    void relabel( Bipartite& n_to_l, const std::vector<size_t> &owner )
+    {
+      size_t L = n_to_l.sizeB();
+      std::vector<char> kept( L, 0 );
+      for ( auto& l : owner ) {
+        if ( NULL_NODE != l ) kept[l] = 1;
+      }
+      std::vector<size_t> index( L, NULL_NODE );
+      origin.clear();
+      for ( size_t l=0; l<L; l++ ) {
+        if ( kept[l] ) {
+          index[l] = origin.size();
+          origin.push_back( l );
+        }
+      }
+      centerOf.assign( L, NULL_NODE );
+      for ( size_t l=0; l<L; l++ ) {
+        if ( NULL_NODE != owner[l] ) centerOf[l] = index[owner[l]];
+      }
+
+      size_t N = n_to_l.sizeA();
+      Bipartite compact( N, origin.size() );
+      for ( size_t n=0; n<N; n++ ) {
+        for ( auto& ele : n_to_l.from( n ) ) {
+          compact.add( n, centerOf[ele.first], ele.second );
+        }
+      }
+      n_to_l = std::move( compact );
+    }
+
   private:
 
+    // The Euclidean distance between @param center and @param p.
+    template <typename feature_t>
+    inline double distance( const std::vector<dataType> &center, const feature_t &p ) const
+    {
+      double dist = 0.0;
+      for ( int j=0; j<dim; j++ ) {
+        double tmp = center[j] - p[j];
+        dist += tmp * tmp;
+      }
+      return sqrt( dist );
+    }
+
     template <typename feature_t, template <typename T = feature_t, typename... restArgs> class container>
     void CenterMeans( std::vector<std::vector<dataType> > &centers,
                       const container<feature_t>& feat,
@@ -177,6 +344,23 @@ namespace ran_forest {
 
       Bipartite bimap( N, L );
 
+      // The candidates of data point n are the edges offset[n], ...,
+      // offset[n + 1] - 1, in the order of n_to_l.from( n ). Each edge
+      // keeps a bound on the distance between the point and the
+      // candidate center: an upper bound if the center is one of the
+      // top K of the point (a member), and a lower bound otherwise. As
+      // the centers drift, the bounds are loosened by the drift, and a
+      // point whose members are all closer than its other candidates
+      // keeps its top K without computing any distance.
+      std::vector<size_t> offset( N + 1, 0 );
+      for ( size_t n=0; n<N; n++ ) {
+        offset[n + 1] = offset[n] + n_to_l.from( n ).size();
+      }
+      std::vector<double> bound( offset[N], 0.0 );
+      std::vector<char> member( offset[N], 0 );
+      std::vector<double> drift( L, 0.0 );
+      std::vector<std::vector<dataType> > previous( L );
+
       double lastEnergy = 0.0;
               
       for ( int iter=0; iter<options.maxIter; iter++ ) {
@@ -188,29 +372,83 @@ namespace ran_forest {
           Info( "TMeans iter %d", iter );
         }
         // pick centers
-#       pragma omp parallel for
+#       pragma omp parallel for schedule(dynamic, 256)
         for ( size_t n=0; n<N; n++ ) {
           auto& _to_l = n_to_l.from( n );
+          size_t e0 = offset[n];
+          double upper = std::numeric_limits<double>::max();
+          if ( 0 < iter ) {
+            double lower = std::numeric_limits<double>::max();
+            upper = 0.0;
+            for ( size_t e=e0; e<offset[n + 1]; e++ ) {
+              if ( member[e] ) {
+                upper = std::max( upper, bound[e] );
+              } else {
+                lower = std::min( lower, bound[e] );
+              }
+            }
+            if ( upper < lower ) continue;
+
+            // tighten the upper bounds and try again
+            upper = 0.0;
+            for ( size_t q=0; q<_to_l.size(); q++ ) {
+              if ( !member[e0 + q] ) continue;
+              bound[e0 + q] = distance( centers[_to_l[q].first], feat[n] );
+              upper = std::max( upper, bound[e0 + q] );
+            }
+            if ( upper < lower ) continue;
+          }
+
+          // a candidate farther than every member cannot replace any
+          // of them
           heap<double,size_t> ranker( options.replicate );
-          for ( auto& ele : _to_l ) {
-            size_t l = ele.first;
-            double dist = 0.0;
-            for ( int j=0; j<dim; j++ ) {
-              double tmp = centers[l][j] - feat[n][j];
-              dist += tmp * tmp;
+          for ( size_t q=0; q<_to_l.size(); q++ ) {
+            if ( !member[e0 + q] ) {
+              if ( upper < bound[e0 + q] ) continue;
+              bound[e0 + q] = distance( centers[_to_l[q].first], feat[n] );
             }
-            ranker.add( dist, l );
+            ranker.add( bound[e0 + q], q );
           }
-          
-#         pragma omp critical
+          std::fill( member.begin() + e0, member.begin() + offset[n + 1], 0 );
           for ( int j=0; j<ranker.len; j++ ) {
-            bimap.add( n, ranker[j], 1.0 / options.replicate );
+            member[e0 + ranker[j]] = 1;
           }
-          
         } // end for n
 
+        for ( size_t n=0; n<N; n++ ) {
+          auto& _to_l = n_to_l.from( n );
+          for ( size_t q=0; q<_to_l.size(); q++ ) {
+            if ( member[offset[n] + q] ) {
+              bimap.add( n, _to_l[q].first, 1.0 / options.replicate );
+            }
+          }
+        }
+
+#       pragma omp parallel for
+        for ( size_t l=0; l<L; l++ ) {
+          previous[l].assign( centers[l].begin(), centers[l].end() );
+        }
+
         CenterMeans( centers, feat, bimap );
 
+#       pragma omp parallel for
+        for ( size_t l=0; l<L; l++ ) {
+          drift[l] = distance( centers[l], previous[l] );
+        }
+
+#       pragma omp parallel for
+        for ( size_t n=0; n<N; n++ ) {
+          auto& _to_l = n_to_l.from( n );
+          for ( size_t q=0; q<_to_l.size(); q++ ) {
+            size_t e = offset[n] + q;
+            if ( member[e] ) {
+              bound[e] += drift[_to_l[q].first];
+            } else {
+              bound[e] = std::max( 0.0, bound[e] - drift[_to_l[q].first] );
+            }
+          }
+        }
+
 
 
         // Calculate Energy
@@ -274,30 +512,142 @@ namespace ran_forest {
     }
 
 
+    // +-------------------------------------------------------------------------------
+    // Soft Assignment
+  public:
+
+    // Replace the candidate centers in @param membership by the
+    // options.replicate ones nearest to @param p, nearest first, each
+    // weighted as in the graph returned by Clustering(). The first
+    // of each pair is a center ID, which is a size_t like the columns
+    // of a Bipartite.
     template <typename feature_t>
-    inline void concentrate( const feature_t &p, std::vector<std::pair<int,double> > &membership ) const
+    inline void concentrate( const feature_t &p, std::vector<std::pair<size_t,double> > &membership ) const
     {
-      heap<double,size_t> ranker( options.replicate );
-      for ( auto& ele : membership ) {
-        size_t l = ele.first;
-        double dist = 0.0;
-        for ( int j=0; j<options.dim; j++ ) {
-          double tmp = centers[l][j] - p[j];
-          dist += tmp * tmp;
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      if ( membership.empty() ) return;
+      // the top K are kept in the front of membership itself, which
+      // never grows past the candidates read so far
+      int count = 0;
+      for ( size_t i=0; i<membership.size(); i++ ) {
+        size_t l = membership[i].first;
+        if ( l >= centers.size() ) {
+          Error( "TMeanShell: center %lu does not exist, there are %lu.", l, centers.size() );
+          exit( -1 );
         }
-        ranker.add( sqrt( dist ), l );
+        count = rank( &membership[0], count, l, distL2Sq( &centers[l][0], &p[0], dim ) );
+      }
+      membership.resize( count );
+      normalize( &membership[0], count );
+    }
+
+    // The batched version of concentrate() for serving. Data point i of
+    // @param points comes with its forest query results (see
+    // Forest::query()) in @param nodes, numTrees node IDs per point back
+    // to back, which are mapped to centers by centerOf if Compact() was
+    // called (or its result was read). A node ID with no center, i.e.
+    // beyond the centers, or beyond centerOf when it is set, is an
+    // error. Point i gets options.replicate slots in @param
+    // membership, starting at i * options.replicate, nearest center
+    // first, and the slots left over when it has fewer candidates hold
+    // ( NULL_NODE, 0.0 ). No memory is allocated once membership has
+    // the capacity for the batch.
+    template <typename feature_t>
+    void concentrate( const std::vector<feature_t> &points,
+                      const std::vector<size_t> &nodes,
+                      std::vector<std::pair<size_t,double> > &membership ) const
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      size_t N = points.size();
+      if ( 0 == N ) {
+        membership.clear();
+        return;
       }
-      membership.resize( ranker.len );
+      if ( 0 != nodes.size() % N ) {
+        Error( "TMeanShell: the number of node IDs is not a multiple of the number of points." );
+        exit( -1 );
+      }
+      size_t T = nodes.size() / N;
+      size_t K = static_cast<size_t>( options.replicate );
+      membership.resize( N * K );
+      bool outOfRange = false;
+
+#     pragma omp parallel for reduction(||:outOfRange)
+      for ( size_t i=0; i<N; i++ ) {
+        std::pair<size_t,double> *slots = &membership[i * K];
+        int count = 0;
+        for ( size_t t=0; t<T; t++ ) {
+          size_t l = nodes[i * T + t];
+          if ( !centerOf.empty() ) {
+            if ( l >= centerOf.size() ) {
+              outOfRange = true;
+              continue;
+            }
+            l = centerOf[l];
+            if ( NULL_NODE == l ) continue;
+          }
+          if ( l >= centers.size() ) {
+            outOfRange = true;
+            continue;
+          }
+          count = rank( slots, count, l, distL2Sq( &centers[l][0], &points[i][0], dim ) );
+        }
+        normalize( slots, count );
+        for ( size_t k=count; k<K; k++ ) {
+          slots[k] = std::make_pair( NULL_NODE, 0.0 );
+        }
+      }
+
+      if ( outOfRange ) {
+        Error( "TMeanShell: some node IDs have no center, might be due to a forest that changed since Compact()." );
+        exit( -1 );
+      }
+    }
+
+  private:
+
+    // Insert center @param l at squared distance @param d into the
+    // @param count slots sorted by distance, keeping at most
+    // options.replicate of them (an insertion sort, as K is small and
+    // only known at run time). Returns the new count.
+    template <typename slot_t>
+    inline int rank( slot_t *slots, int count, size_t l, double d ) const
+    {
+      if ( count == options.replicate ) {
+        if ( !( d < slots[count - 1].second ) ) return count;
+        count--;
+      }
+      int j = count;
+      while ( 0 < j && d < slots[j - 1].second ) {
+        slots[j] = slots[j - 1];
+        j--;
+      }
+      slots[j].first = l;
+      slots[j].second = d;
+      return count + 1;
+    }
+
+    // Turn the squared distances of the @param count slots into
+    // weights exp( - distance / options.wtBandwidth ) normalized to sum
+    // to 1. The distances are taken relative to the nearest one, which
+    // leaves the normalized weights unchanged but keeps them from
+    // underflowing.
+    template <typename slot_t>
+    inline void normalize( slot_t *slots, int count ) const
+    {
+      if ( 0 == count ) return;
+      double nearest = sqrt( slots[0].second );
       double s = 0.0;
-      for ( int i=0; i<ranker.len; i++ ) {
-        membership[i].first = ranker[i];
-        membership[i].second = exp( - ranker(i) / options.wtBandwidth );
-	s += membership[i].second;
+      for ( int i=0; i<count; i++ ) {
+        slots[i].second = exp( - ( sqrt( slots[i].second ) - nearest ) / options.wtBandwidth );
+        s += slots[i].second;
       }
       // normalization
       s = 1.0 / s;
-      for ( int i=0; i<ranker.len; i++ ) {
-	membership[i].second *= s;
+      for ( int i=0; i<count; i++ ) {
+        slots[i].second *= s;
       }
     }
   };
@@ -0,0 +1,112 @@
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <new>
+#include <random>
+#include <vector>
+#include "LLPack/utils/extio.hpp"
+#include "../RanForest.hpp"
+
+using namespace ran_forest;
+
+// Checks that splitting a node allocates nothing: every call to the
+// global operator new is counted, and the elections of the VP kernel
+// are run once the buffers it shares across a tree are large enough.
+
+static std::atomic<size_t> numNews( 0 );
+
+void* __attribute__((noinline)) operator new( size_t bytes )
+{
+  numNews++;
+  void *p = malloc( bytes > 0 ? bytes : 1 );
+  if ( nullptr == p ) throw std::bad_alloc();
+  return p;
+}
+
+// kept out of line, so that the compiler does not pair the malloc()
+// and free() inside with the new and delete expressions
+void __attribute__((noinline)) operator delete( void *p ) noexcept
+{
+  free( p );
+}
+
+void __attribute__((noinline)) operator delete( void *p, size_t __attribute__((__unused__)) bytes ) noexcept
+{
+  free( p );
+}
+
+
+
+int main()
+{
+  int numTrees = 4;
+  int numSplits = 5000;
+  size_t N = 20000;
+  int dim = 32;
+
+  std::default_random_engine engine;
+  std::uniform_real_distribution<float> dist( 0.0, 1.0 );
+  std::vector<std::vector<float> > features( N, std::vector<float>( dim ) );
+  for ( auto& row : features ) {
+    for ( auto& ele : row ) ele = dist( engine );
+  }
+
+  VP<float>::Options options;
+  RandomStream rng( 0 );
+  std::vector<size_t> idx( N );
+  for ( size_t i=0; i<N; i++ ) idx[i] = i;
+
+  // The election at the root sizes the distance buffer for every node
+  // of the tree, and one at a node small enough to be shuffled sizes
+  // the hypothesis buffer.
+  Arena arena;
+  VP<float>::State root( &idx[0], N, options );
+  BinaryOnDistance<float> judge;
+  judge.bind( &arena );
+  VP<float>::ElectSplitter( features, dim, root, judge, options, rng );
+  VP<float>::State small( &idx[0], options.numHypo * 16, root );
+  VP<float>::ElectSplitter( features, dim, small, judge, options, rng );
+
+  // Elect the splitters of nodes of the sizes found at every depth
+  // of a tree, each into a fresh splitter bound to the arena as Forest
+  // does. A split may only allocate when the arena takes a new chunk.
+  int failed = 0;
+  for ( int s=0; s<numSplits; s++ ) {
+    size_t len = std::max( options.stopNum, N >> ( s % 12 ) );
+    size_t offset = std::uniform_int_distribution<size_t>( 0, N - len )( engine );
+    VP<float>::State state( &idx[offset], len, root );
+    BinaryOnDistance<float> splitter;
+    splitter.bind( &arena );
+    size_t news = numNews.load();
+    size_t bytes = arena.bytes();
+    if ( SUCCESS != VP<float>::ElectSplitter( features, dim, state, splitter, options, rng ) ) {
+      Error( "split %d of %lu points failed.", s, len );
+      return -1;
+    }
+    if ( numNews.load() != news && arena.bytes() == bytes ) failed++;
+  }
+  Info( "%d/%d splits allocated", failed, numSplits );
+
+  // The same over the whole growth path, measured on a second growth
+  // so that the thread pool and the runtime are warmed up. The
+  // worklist, the node arrays and the arena grow geometrically, so the
+  // allocations left are a few per tree, logarithmic in its size,
+  // which stays below one per splitsPerNew splits.
+  const size_t splitsPerNew = 32;
+  {
+    Forest<float,VP> warmup;
+    warmup.grow( numTrees, features, dim, options );
+  }
+  Forest<float,VP> forest;
+  size_t news = numNews.load();
+  forest.grow( numTrees, features, dim, options );
+  news = numNews.load() - news;
+  size_t splits = forest.numNodes() - forest.numLeaves();
+  Info( "%lu allocations for %lu splits", news, splits );
+
+  if ( 0 < failed || news * splitsPerNew > splits ) {
+    Error( "node splits are not allocation free." );
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,54 @@
+// Helpers shared by the examples that compare forests.
+
+
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "../RanForest.hpp"
+
+using namespace ran_forest;
+
+// Whether tree @param ta of @param a and tree @param tb of @param b
+// have the same shape, splitters and leaf stores. The trees are walked
+// side by side, so the node IDs of the two forests may differ. The
+// splitters are compared only if @param compareJudges.
+template <typename dataType, template <typename> class kernel>
+bool sameTree( const Forest<dataType,kernel> &a, int ta, const Forest<dataType,kernel> &b, int tb,
+               bool compareJudges = true )
+{
+  std::vector<std::pair<size_t,size_t> > stack( 1, std::make_pair( a.treeRoot( ta ), b.treeRoot( tb ) ) );
+  while ( !stack.empty() ) {
+    size_t x = stack.back().first;
+    size_t y = stack.back().second;
+    stack.pop_back();
+    const auto &cx = a.childrenView( x );
+    const auto &cy = b.childrenView( y );
+    if ( cx.size() != cy.size() ) return false;
+    if ( cx.empty() ) {
+      std::vector<size_t> sx = a.getStore( x );
+      std::vector<size_t> sy = b.getStore( y );
+      std::sort( sx.begin(), sx.end() );
+      std::sort( sy.begin(), sy.end() );
+      if ( sx != sy ) return false;
+      continue;
+    }
+    if ( compareJudges && !( a.getJudge( x ) == b.getJudge( y ) ) ) return false;
+    for ( size_t k=0; k<cx.size(); k++ ) stack.push_back( std::make_pair( cx[k], cy[k] ) );
+  }
+  return true;
+}
+
+template <typename dataType, template <typename> class kernel>
+bool sameForest( const Forest<dataType,kernel> &a, const Forest<dataType,kernel> &b,
+                 bool compareJudges = true )
+{
+  if ( a.numTrees() != b.numTrees() || a.numNodes() != b.numNodes() || a.dimension() != b.dimension() ) {
+    return false;
+  }
+  for ( int t=0; t<a.numTrees(); t++ ) {
+    if ( !sameTree( a, t, b, t, compareJudges ) ) return false;
+  }
+  return true;
+}
@@ -0,0 +1,144 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include <omp.h>
+#include "LLPack/utils/extio.hpp"
+#include "../RanForest.hpp"
+#include "compare.hpp"
+
+using namespace ran_forest;
+
+// Checks that the ways of growing a forest agree: the same seed grows
+// the same forest with any number of threads, growShard() and
+// gather() (or write() and read()) assemble the forest grow() grows,
+// and LEVEL order growth, which elects the splitters in another
+// order, grows valid trees over the same bags as DFS order.
+
+typedef Forest<float,VP> RF;
+
+// Whether every data point in the bag of each tree of @param forest
+// is stored in the leaf it reaches, and the leaves of each tree store
+// exactly its bag.
+bool storesBags( const RF &forest, const std::vector<std::vector<float> > &features )
+{
+  for ( int t=0; t<forest.numTrees(); t++ ) {
+    const std::vector<uint64_t> &bag = forest.treeBag( t );
+    std::vector<size_t> stored;
+    for ( size_t i=0; i<features.size(); i++ ) {
+      if ( 0 == ( bag[i >> 6] & ( static_cast<uint64_t>( 1 ) << ( i & 63 ) ) ) ) continue;
+      const auto &store = forest.storeView( forest.queryTree( features[i], t ) );
+      if ( std::find( store.begin(), store.end(), i ) == store.end() ) return false;
+      stored.push_back( i );
+    }
+    size_t total = 0;
+    std::vector<size_t> stack( 1, forest.treeRoot( t ) );
+    while ( !stack.empty() ) {
+      size_t nodeID = stack.back();
+      stack.pop_back();
+      const auto &children = forest.childrenView( nodeID );
+      if ( children.empty() ) total += forest.storeView( nodeID ).size();
+      stack.insert( stack.end(), children.begin(), children.end() );
+    }
+    if ( total != stored.size() ) return false;
+  }
+  return true;
+}
+
+
+
+int main()
+{
+  int numTrees = 6;
+  size_t N = 8000;
+  int dim = 32;
+  uint64_t seed = 3;
+
+  std::default_random_engine engine;
+  std::uniform_real_distribution<float> dist( 0.0, 1.0 );
+  std::vector<std::vector<float> > features( N, std::vector<float>( dim ) );
+  for ( auto& row : features ) {
+    for ( auto& ele : row ) ele = dist( engine );
+  }
+  VP<float>::Options options;
+  options.proportion = 0.7;
+
+  int failed = 0;
+
+  // Sharded growth comes first, as the ranks must be forked before
+  // OpenMP starts its threads (see runLocal()). Rank 0 checks the
+  // gathered forest, and the shards written by every rank are read
+  // back together afterwards.
+  int numShards = 3;
+  std::string dir = "growth.shard";
+  int code = runLocal( numShards, [&]( Transport &transport )
+                       {
+                         RF shard;
+                         shard.setRandomSeed( seed );
+                         shard.growShard( numTrees, features, dim, options, transport.rank(), numShards, true );
+                         shard.write( strf( "%s%d", dir.c_str(), transport.rank() ) );
+                         if ( !shard.gather( transport ) ) return -1;
+                         if ( 0 != transport.rank() ) return 0;
+                         RF whole;
+                         whole.setRandomSeed( seed );
+                         whole.grow( numTrees, features, dim, options, true );
+                         return sameForest( whole, shard ) ? 0 : -1;
+                       } );
+  if ( 0 != code ) {
+    Error( "the forest gathered from the shards differs from the one grown." );
+    failed++;
+  }
+
+  RF reference;
+  reference.setRandomSeed( seed );
+  reference.grow( numTrees, features, dim, options, true );
+
+  std::vector<std::string> dirs;
+  for ( int s=0; s<numShards; s++ ) dirs.push_back( strf( "%s%d", dir.c_str(), s ) );
+  RF merged;
+  merged.read( dirs, true );
+  if ( !sameForest( reference, merged ) ) {
+    Error( "the forest read from the shards differs from the one grown." );
+    failed++;
+  }
+  for ( auto& d : dirs ) system( ( "rm -rf " + d ).c_str() );
+
+  omp_set_num_threads( 1 );
+  RF level;
+  level.setRandomSeed( seed );
+  level.grow<LEVEL>( numTrees, features, dim, options, true );
+
+  // the number of threads changes nothing, in either order
+  for ( int threads : { 2, 3, 8 } ) {
+    omp_set_num_threads( threads );
+    RF forest;
+    forest.setRandomSeed( seed );
+    forest.grow( numTrees, features, dim, options, true );
+    RF levelAgain;
+    levelAgain.setRandomSeed( seed );
+    levelAgain.grow<LEVEL>( numTrees, features, dim, options, true );
+    if ( !sameForest( reference, forest ) || !sameForest( level, levelAgain ) ) {
+      Error( "the forest grown with %d threads differs.", threads );
+      failed++;
+    }
+  }
+
+  // LEVEL order draws the same bags, and stores every point of them
+  // where it is routed
+  for ( int t=0; t<numTrees; t++ ) {
+    if ( level.treeBag( t ) != reference.treeBag( t ) ) {
+      Error( "tree %d has different bags in LEVEL and DFS order.", t );
+      failed++;
+    }
+  }
+  if ( !storesBags( level, features ) || !storesBags( reference, features ) ) {
+    Error( "the leaves do not store the bags." );
+    failed++;
+  }
+  Info( "DFS: %lu leaves, depth %d. LEVEL: %lu leaves, depth %d.", reference.numLeaves(), reference.depth(),
+        level.numLeaves(), level.depth() );
+
+  return 0 < failed ? -1 : 0;
+}
@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include "LLPack/utils/extio.hpp"
+#include "../RanForest.hpp"
+#include "compare.hpp"
+
+using namespace ran_forest;
+
+// Checks that writing a forest and reading it back gives the same
+// trees, in the plain format and in the compact format at full
+// precision (with and without LZ), and that the compact format at a
+// lossy precision still reads back a forest of the same shape.
+
+typedef Forest<float,VP> RF;
+
+// The number of (point, tree) pairs for which @param a and @param b
+// reach leaves with different stores.
+size_t countMoved( const RF &a, const RF &b, const std::vector<std::vector<float> > &features )
+{
+  size_t moved = 0;
+  for ( auto& p : features ) {
+    std::vector<size_t> x = a.query( p );
+    std::vector<size_t> y = b.query( p );
+    for ( int t=0; t<a.numTrees(); t++ ) {
+      std::vector<size_t> sx = a.getStore( x[t] );
+      std::vector<size_t> sy = b.getStore( y[t] );
+      std::sort( sx.begin(), sx.end() );
+      std::sort( sy.begin(), sy.end() );
+      if ( sx != sy ) moved++;
+    }
+  }
+  return moved;
+}
+
+
+
+int main()
+{
+  int numTrees = 4;
+  size_t N = 5000;
+  std::string dir = "roundtrip.forest";
+
+  int failed = 0;
+  // 32 takes the fixed dimension kernels (see aux/Distance.hpp), 13
+  // the runtime one
+  for ( int dim : { 32, 13 } ) {
+    std::default_random_engine engine( dim );
+    std::uniform_real_distribution<float> dist( 0.0, 1.0 );
+    std::vector<std::vector<float> > features( N, std::vector<float>( dim ) );
+    for ( auto& row : features ) {
+      for ( auto& ele : row ) ele = dist( engine );
+    }
+
+    VP<float>::Options options;
+    options.proportion = 0.7;
+    RF forest;
+    forest.setRandomSeed( 1 );
+    forest.grow( numTrees, features, dim, options, true );
+
+    RF::Format formats[] = { RF::Format(), RF::Format( FULL_PRECISION ), RF::Format( FULL_PRECISION, true ) };
+    for ( auto& format : formats ) {
+      forest.write( dir, format );
+      RF copy;
+      copy.read( dir, true );
+      if ( !sameForest( forest, copy ) || 0 < countMoved( forest, copy, features ) ) {
+        Error( "dim %d: the forest read back (compact %d, lz %d) differs.", dim, format.compact, format.lz );
+        failed++;
+      }
+      for ( int t=0; t<numTrees; t++ ) {
+        if ( forest.treeBag( t ) != copy.treeBag( t ) ) {
+          Error( "dim %d: the bag of tree %d read back (compact %d) differs.", dim, t, format.compact );
+          failed++;
+        }
+      }
+    }
+
+    // the lossy precisions keep the shape and the leaf stores, and only
+    // move points close to the thresholds
+    for ( Precision precision : { HALF_PRECISION, BYTE_PRECISION } ) {
+      forest.write( dir, RF::Format( precision ) );
+      RF copy;
+      copy.read( dir, true );
+      size_t moved = countMoved( forest, copy, features );
+      Info( "dim %d, precision %d: %lu/%lu (point, tree) pairs moved", dim, precision, moved, N * numTrees );
+      if ( !sameForest( forest, copy, false ) || moved * 10 > N * numTrees ) {
+        Error( "dim %d: the forest read back at precision %d differs.", dim, precision );
+        failed++;
+      }
+    }
+  }
+
+  system( ( "rm -rf " + dir ).c_str() );
+  return 0 < failed ? -1 : 0;
+}
@@ -0,0 +1,106 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "LLPack/utils/extio.hpp"
+#include "../RanForest.hpp"
+
+using namespace ran_forest;
+
+// Checks that LazyForest, LevelForest and BinaryForest, which answer
+// queries from other representations of a forest, reach the same
+// nodes as Forest::query(), at every depth they support.
+
+typedef Forest<float,VP> RF;
+
+
+
+int main()
+{
+  int numTrees = 4;
+  size_t N = 4000;
+  std::string dir = "views.forest";
+
+  int failed = 0;
+  // 32 takes the fixed dimension kernels (see aux/Distance.hpp), 13
+  // the runtime one
+  for ( int dim : { 32, 13 } ) {
+    std::default_random_engine engine( dim );
+    std::uniform_real_distribution<float> dist( 0.0, 1.0 );
+    // the training points, followed by as many unseen ones
+    std::vector<std::vector<float> > features( N * 2, std::vector<float>( dim ) );
+    for ( auto& row : features ) {
+      for ( auto& ele : row ) ele = dist( engine );
+    }
+    std::vector<std::vector<float> > train( features.begin(), features.begin() + N );
+
+    VP<float>::Options options;
+    RF forest;
+    forest.setRandomSeed( 2 );
+    forest.grow( numTrees, train, dim, options, true );
+    forest.write( dir );
+
+    for ( int lv : { -1, 0, 2, 5 } ) {
+      LevelForest<float,VP> levels( forest, lv );
+      BinaryForest<float> binary( forest, lv );
+      std::vector<size_t> codes = binary.batchQuery( features );
+      size_t wrong = 0;
+      for ( size_t i=0; i<features.size(); i++ ) {
+        std::vector<size_t> expected = forest.query( features[i], lv );
+        for ( int t=0; t<numTrees; t++ ) {
+          size_t code = levels.queryTree( features[i], t );
+          if ( levels.originOf( levels.column( t, code ) ) != expected[t] ) wrong++;
+          if ( binary.queryTree( &features[i][0], t ) != code ) wrong++;
+          if ( codes[i * numTrees + t] != code ) wrong++;
+        }
+      }
+      if ( 0 < wrong ) {
+        Error( "dim %d, level %d: %lu queries of LevelForest or BinaryForest differ.", dim, lv, wrong );
+        failed++;
+      }
+    }
+
+    // LazyForest numbers the nodes of each tree on its own, so the
+    // nodes it reaches must match those of the forest one to one. The
+    // second budget is smaller than the forest, so that trees are
+    // dropped and read again, which is slow enough to query only a
+    // sample with it.
+    for ( size_t budget : { static_cast<size_t>( 0 ), forest.numNodes() * 64 } ) {
+      LazyForest<float,VP> lazy( dir, budget );
+      std::vector<std::map<size_t,size_t> > toLazy( numTrees );
+      std::vector<std::map<size_t,size_t> > fromLazy( numTrees );
+      size_t wrong = 0;
+      for ( size_t i=0; i<features.size(); i+=( 0 == budget ? 1 : 40 ) ) {
+        // deeper step by step, then all the way
+        for ( int lv : { 1, 4, -1 } ) {
+          std::vector<size_t> expected = forest.query( features[i], lv );
+          std::vector<size_t> got = lazy.query( features[i], lv );
+          for ( int t=0; t<numTrees; t++ ) {
+            auto x = toLazy[t].insert( std::make_pair( expected[t], got[t] ) ).first;
+            auto y = fromLazy[t].insert( std::make_pair( got[t], expected[t] ) ).first;
+            if ( x->second != got[t] || y->second != expected[t] ) wrong++;
+          }
+        }
+        std::vector<size_t> leaves = forest.query( features[i] );
+        std::vector<size_t> got = lazy.query( features[i] );
+        for ( int t=0; t<numTrees; t++ ) {
+          std::vector<size_t> expected = forest.getStore( leaves[t] );
+          std::vector<size_t> stored = lazy.getStore( t, got[t] );
+          std::sort( expected.begin(), expected.end() );
+          std::sort( stored.begin(), stored.end() );
+          if ( expected != stored ) wrong++;
+        }
+      }
+      if ( 0 < wrong ) {
+        Error( "dim %d, budget %lu: %lu queries of LazyForest differ.", dim, budget, wrong );
+        failed++;
+      }
+    }
+  }
+
+  system( ( "rm -rf " + dir ).c_str() );
+  return 0 < failed ? -1 : 0;
+}
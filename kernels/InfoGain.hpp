@@ -0,0 +1,271 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+//
+// This file implements the supervised Information Gain Kernel
+// (packaged as class InfoGain), see kernels/VP.hpp for the description
+// of kernels.
+//
+// Each node draws options.numHypo candidate features. For each of
+// them the data points of the node are sorted on that feature, and
+// the class histograms of the two sides are updated incrementally
+// while sweeping the threshold through the sorted values, so that
+// every threshold is scored in O(1) by its Gini or entropy gain. The
+// candidate features are scored in parallel when nested parallelism
+// is enabled and the node is large enough.
+//
+// The State of a node carries the class histogram of its data points.
+// The histograms of the two sides of the elected split are handed
+// down to the children, so that no node counts its labels again.
+
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include "../aux/Sampling.hpp"
+#include "../tree/define.hpp"
+#include "../splitters/BinaryOnAxis.hpp"
+
+namespace ran_forest
+{
+  enum GainCriterion { GINI_GAIN, ENTROPY_GAIN };
+
+  template <typename dataType>
+  class InfoGain
+  {
+  public:
+    typedef BinaryOnAxis<dataType> splitter;
+
+    struct Options
+    {
+      // the class of each data point ID, in [0, numClasses)
+      const std::vector<int> *labels;
+      int numClasses;
+      GainCriterion criterion;
+      // stop criteria
+      int maxDepth;
+      size_t stopNum;
+      // splits gaining no more than minGain are not taken
+      double minGain;
+      double proportion;
+      // number of candidate features per node, 0 for sqrt(dim)
+      size_t numHypo;
+      // the candidates of nodes with fewer data points than this are
+      // scored serially
+      size_t parallelNum;
+      // the labels are looked up by the data point IDs in State::idx,
+      // so gathered growth (see VP::Options) is not supported
+      static const size_t gatherNum = 0;
+
+      Options() :
+        labels(nullptr), numClasses(0), criterion(GINI_GAIN), maxDepth(-1), stopNum(5),
+        minGain(1e-12), proportion(1.1), numHypo(0), parallelNum(4096) {}
+
+      Options( const std::vector<int> &labels, int numClasses ) :
+        labels(&labels), numClasses(numClasses), criterion(GINI_GAIN), maxDepth(-1), stopNum(5),
+        minGain(1e-12), proportion(1.1), numHypo(0), parallelNum(4096) {}
+    };
+
+    class State
+    {
+    public:
+      size_t *idx;
+      size_t len;
+      int depth;
+
+      // class histogram of the data points of this node
+      std::vector<size_t> counts;
+      // set by ElectSplitter: the histograms of the two branches of the
+      // elected split, taken by the children in the order they are
+      // created
+      std::vector<std::vector<size_t> > branchCounts;
+      mutable size_t nextBranch;
+
+      State( size_t *i, size_t l, const Options &options )
+        : idx(i), len(l), depth(0), counts(), branchCounts(), nextBranch(0)
+      {
+        count( options.labels, options.numClasses );
+      }
+
+      State( size_t *i, size_t l, const State& other )
+        : idx(i), len(l), depth( other.depth + 1 ), counts(), branchCounts(), nextBranch(0)
+      {
+        if ( other.nextBranch < other.branchCounts.size() ) {
+          counts = other.branchCounts[other.nextBranch++];
+        }
+      }
+
+      State( State&& other )
+        : idx( other.idx ), len( other.len ), depth( other.depth ),
+          counts( std::move( other.counts ) ), branchCounts( std::move( other.branchCounts ) ),
+          nextBranch( other.nextBranch ) {}
+
+      // count the labels of the data points unless the histogram
+      // handed down covers exactly them
+      inline void count( const std::vector<int> *labels, int numClasses )
+      {
+        if ( nullptr == labels ) return;
+        size_t total = 0;
+        for ( auto& c : counts ) total += c;
+        if ( static_cast<int>( counts.size() ) == numClasses && total == len ) return;
+        counts.assign( numClasses, 0 );
+        for ( size_t i=0; i<len; i++ ) counts[(*labels)[idx[i]]]++;
+      }
+    };
+
+  private:
+
+    // Incremental impurity of a histogram, kept as a sum over the
+    // classes, so that moving one point between histograms is O(1).
+    //   Gini:    sum c^2, impurity n - sum c^2 / n
+    //   entropy: sum c log c, impurity n log n - sum c log c
+    // Both impurities are weighted by the number of points n.
+    static inline double term( GainCriterion criterion, size_t c )
+    {
+      double x = static_cast<double>( c );
+      if ( GINI_GAIN == criterion ) return x * x;
+      return 0 < c ? x * std::log( x ) : 0.0;
+    }
+
+    static inline double impurity( GainCriterion criterion, double sum, size_t n )
+    {
+      if ( 0 == n ) return 0.0;
+      double x = static_cast<double>( n );
+      if ( GINI_GAIN == criterion ) return x - sum / x;
+      return x * std::log( x ) - sum;
+    }
+
+    struct Candidate
+    {
+      double gain;
+      double th;
+      std::vector<size_t> left;
+      Candidate() : gain(-1.0), th(0.0), left() {}
+    };
+
+    // Score every threshold on feature @param axis by sweeping the
+    // data points sorted on it, and return the best one.
+    template <typename feature_t>
+    static Candidate score( const std::vector<feature_t>& dataPoints,
+                            const State& state,
+                            const Options& options,
+                            int axis,
+                            std::vector<std::pair<dataType, int> > &sorted )
+    {
+      const std::vector<int> &labels = *options.labels;
+      GainCriterion criterion = options.criterion;
+      for ( size_t i=0; i<state.len; i++ ) {
+        sorted[i] = std::make_pair( dataPoints[state.idx[i]][axis], labels[state.idx[i]] );
+      }
+      std::sort( sorted.begin(), sorted.end() );
+
+      std::vector<size_t> left( options.numClasses, 0 );
+      std::vector<size_t> right( state.counts );
+      double sumLeft = 0.0;
+      double sumRight = 0.0;
+      for ( auto& c : right ) sumRight += term( criterion, c );
+      double parent = impurity( criterion, sumRight, state.len );
+
+      Candidate best;
+      size_t bestPos = 0;
+      for ( size_t i=0; i+1<state.len; i++ ) {
+        int k = sorted[i].second;
+        sumLeft += term( criterion, left[k] + 1 ) - term( criterion, left[k] );
+        sumRight += term( criterion, right[k] - 1 ) - term( criterion, right[k] );
+        left[k]++;
+        right[k]--;
+        if ( !( sorted[i].first < sorted[i+1].first ) ) continue;
+        double gain = parent - impurity( criterion, sumLeft, i + 1 )
+          - impurity( criterion, sumRight, state.len - i - 1 );
+        if ( gain > best.gain ) {
+          best.gain = gain;
+          bestPos = i;
+        }
+      }
+      if ( best.gain < 0.0 ) return best;
+
+      // place the threshold between the two values, strictly above
+      // the lower one
+      double lo = static_cast<double>( sorted[bestPos].first );
+      double hi = static_cast<double>( sorted[bestPos+1].first );
+      best.th = 0.5 * ( lo + hi );
+      if ( !( best.th > lo ) ) best.th = hi;
+      best.gain /= state.len;
+      best.left.assign( options.numClasses, 0 );
+      for ( size_t i=0; i<=bestPos; i++ ) best.left[sorted[i].second]++;
+      return best;
+    }
+
+  public:
+
+    template <typename feature_t>
+    static inline ElectionStatus ElectSplitter( const std::vector<feature_t>& dataPoints,
+                                                int dim,
+                                                State& state,
+                                                splitter& judger,
+                                                Options& options,
+                                                RandomStream& rng )
+    {
+      if ( nullptr == options.labels || options.numClasses <= 0 ) {
+        Error( "RanForest: InfoGain requires the labels and the number of classes in its Options." );
+        exit( -1 );
+      }
+
+      if ( state.len < options.stopNum ) {
+        return NODE_SIZE_LIMIT_REACHED;
+      }
+
+      if ( options.maxDepth == state.depth ) {
+        return MAX_DEPTH_REACHED;
+      }
+
+      state.count( options.labels, options.numClasses );
+      for ( auto& c : state.counts ) {
+        if ( c == state.len ) return CONVERGED;
+      }
+
+      size_t numHypo = options.numHypo;
+      if ( 0 == numHypo ) {
+        numHypo = static_cast<size_t>( std::sqrt( static_cast<double>( dim ) ) + 0.5 );
+      }
+      numHypo = std::max<size_t>( 1, std::min<size_t>( numHypo, dim ) );
+      std::vector<size_t> axes = randperm( rng, dim, numHypo );
+
+      std::vector<Candidate> candidates( axes.size() );
+      bool parallel = state.len >= options.parallelNum;
+#     pragma omp parallel if ( parallel )
+      {
+        std::vector<std::pair<dataType, int> > sorted( state.len );
+#       pragma omp for schedule(dynamic)
+        for ( size_t h=0; h<axes.size(); h++ ) {
+          candidates[h] = score( dataPoints, state, options, static_cast<int>( axes[h] ), sorted );
+        }
+      }
+
+      // the first of the best candidates, independent of scheduling
+      size_t selected = 0;
+      for ( size_t h=1; h<candidates.size(); h++ ) {
+        if ( candidates[h].gain > candidates[selected].gain ) selected = h;
+      }
+      Candidate &best = candidates[selected];
+      if ( best.gain <= options.minGain ) {
+        return NULL_HYPOTHESIS_SET;
+      }
+
+      judger.axis = static_cast<int>( axes[selected] );
+      judger.th = best.th;
+      state.branchCounts.resize( 2 );
+      state.branchCounts[1] = state.counts;
+      for ( int k=0; k<options.numClasses; k++ ) {
+        state.branchCounts[1][k] -= best.left[k];
+      }
+      state.branchCounts[0].swap( best.left );
+      state.nextBranch = 0;
+      return SUCCESS;
+    }
+  };
+}
@@ -29,7 +29,7 @@
 // ----------------------------------------------------------------------
 // 5. have a static function named ElectSplitter. It will generate
 // hypothesis for split and pick the best one based on certain
-// criteria, as specified by the implementor. This function takes 5
+// criteria, as specified by the implementor. This function takes 6
 // parameters:
 // - a vector of feature_t that contains all the feature vectors used
 //   to build the tree.
@@ -37,19 +37,30 @@
 // - a @typename State variable ref that describe the current node,
 //   see above for details
 // - a @typename splitter variable ref that will be used to hold the
-//   elected splitter if the election trial is successful
+//   elected splitter if the election trial is successful, and should
+//   be left untouched otherwise. It is the splitter of the node itself,
+//   so that the elected splitter is written in place.
 // - a @typename Option variable ref that provides the options
+// - a RandomStream variable ref (see aux/Random.hpp), the random
+//   number stream of the tree being grown, which should be the only
+//   source of randomness of the function
 // 
 // This function returns a ElectionStatus variable. It will be SUCCESS
 // if the election trial is successful, or others as defined in
 // tree/define.hpp.
+// ----------------------------------------------------------------------
+// 6. optionally, to support the LEVEL splitting order, have a struct
+// named Proposal and static functions Propose(), numStats(), Measure()
+// and Elect(), see VP below for details.
 
 
 
 #pragma once
 
+#include <memory>
 #include <algorithm>
-#include "LLPack/algorithms/random.hpp"
+#include "../aux/Sampling.hpp"
+#include "../aux/Distance.hpp"
 #include "../tree/define.hpp"
 #include "../splitters/BinaryOnDistance.hpp"
 
@@ -73,12 +84,25 @@ namespace ran_forest
       double proportion;
       // other
       size_t numHypo;
+      // nodes holding no more than gatherNum points are grown from a
+      // contiguous private copy of their feature rows (0 disables)
+      size_t gatherNum;
       
       Options() : 
-        maxDepth(-1), stopNum(5), converge(0), proportion(1.1), numHypo(10) {}
+        maxDepth(-1), stopNum(5), converge(0), proportion(1.1), numHypo(10), gatherNum(0) {}
     };
 
     
+    // buffers of the elections, created with the root of a tree and
+    // shared by all its nodes (which are split one at a time), so that
+    // splitting a node allocates nothing once they are large enough
+    struct Scratch
+    {
+      std::vector<size_t> vpid;
+      std::vector<double> distances;
+      std::vector<const dataType*> rows;
+    };
+
     // 4. State
     class State
     {
@@ -89,19 +113,15 @@ namespace ran_forest
       int depth;
       
       // extra properties
+      std::shared_ptr<Scratch> scratch;
       
       State( size_t *i, size_t l, const Options __attribute__((__unused__)) &options )
-        : idx(i), len(l), depth(0) {}
+        : idx(i), len(l), depth(0), scratch( std::make_shared<Scratch>() ) {}
       
       State( size_t *i, size_t l, const State& other )
-        : idx(i), len(l), depth( other.depth + 1 ) {}
+        : idx(i), len(l), depth( other.depth + 1 ), scratch( other.scratch ) {}
 
-      State( State&& other )
-      {
-        idx = other.idx;
-        len = other.len;
-        depth = other.depth;
-      }
+      State( State&& other ) = default;
     };
 
 
@@ -111,7 +131,8 @@ namespace ran_forest
                                                 int dim,
                                                 State& state,
                                                 splitter& judger, 
-                                                Options& options )
+                                                Options& options,
+                                                RandomStream& rng )
     {
 
       if ( state.len < options.stopNum ) {
@@ -122,35 +143,24 @@ namespace ran_forest
         return MAX_DEPTH_REACHED;
       }
       
-      std::vector<size_t> vpid = rndgen::randperm( state.len, options.numHypo ); // TODO: size_t of randperm
+      std::vector<size_t> &vpid = state.scratch->vpid;
+      randperm( rng, state.len, options.numHypo, vpid );
       double bestScore = -1.0;
       double th = 0.0;
       size_t selected = 0;
-      std::vector<double> distances( state.len );
+      std::vector<double> &distances = state.scratch->distances;
+      distances.resize( state.len );
+      std::vector<const dataType*> &rows = state.scratch->rows;
+      rows.resize( state.len );
+      for ( size_t i=0; i<state.len; i++ ) rows[i] = &dataPoints[state.idx[i]][0];
       for ( auto& ele : vpid ) {
-        const feature_t &vp = dataPoints[state.idx[ele]];
-        for ( size_t i=0; i<state.len; i++ ) {
-          distances[i] = algebra::dist_l1( vp, dataPoints[state.idx[i]], dim );
-        }
+        distL1OrderedMany( rows[ele], rows.data(), state.len, dim, distances.data() );
         
-        double maxDist = *std::max_element( distances.begin(), distances.end() );
-        
-        if ( maxDist < options.converge ) {
+        double median = 0.0;
+        double score = 0.0;
+        if ( !evaluate( distances, options, median, score ) ) {
           return CONVERGED;
         }
-        // get median
-        std::nth_element( distances.begin(), 
-                          distances.begin() + state.len / 2, 
-                          distances.end() );
-        double median = distances[ state.len / 2 ];
-        // calculate score
-        for ( size_t i=0; i<state.len; i++ ) {
-          distances[i] = fabs( distances[i] - median );
-        }
-        std::nth_element( distances.begin(),
-                          distances.begin() + state.len / 2,
-                          distances.end() );
-        double score = distances[ state.len / 2 ];
 
         if ( score > bestScore ) {
           bestScore = score;
@@ -168,6 +178,138 @@ namespace ran_forest
       return SUCCESS;
     }
 
+
+    // 6. (optional) Level synchronous election, used when growing with
+    // the LEVEL splitting order (see Forest::expand()). The election of
+    // a node is split into three steps:
+    // - Propose() checks the stop criteria and draws the hypotheses
+    // - Measure() computes numStats() statistics of a single data point
+    //   under the hypotheses. It is called on all the data points of
+    //   all the nodes of a level in one sequential pass.
+    // - Elect() picks the splitter from the statistics of the data
+    //   points of the node (stored point after point), and writes the
+    //   branch label of each of them.
+    struct Proposal
+    {
+      // row IDs of the candidate vantage points
+      std::vector<size_t> vantage;
+    };
+
+    static inline ElectionStatus Propose( const State& state,
+                                          const Options& options,
+                                          RandomStream& rng,
+                                          Proposal& proposal )
+    {
+      if ( state.len < options.stopNum ) {
+        return NODE_SIZE_LIMIT_REACHED;
+      }
+
+      if ( options.maxDepth == state.depth ) {
+        return MAX_DEPTH_REACHED;
+      }
+
+      randperm( rng, state.len, options.numHypo, proposal.vantage );
+      for ( auto& ele : proposal.vantage ) {
+        ele = state.idx[ele];
+      }
+      return SUCCESS;
+    }
+
+    static inline size_t numStats( const Proposal& proposal )
+    {
+      return proposal.vantage.size();
+    }
+
+    template <typename feature_t>
+    static inline void Measure( const std::vector<feature_t>& dataPoints,
+                                int dim,
+                                const Proposal& proposal,
+                                const feature_t& p,
+                                double *stats )
+    {
+      for ( size_t h=0; h<proposal.vantage.size(); h++ ) {
+        stats[h] = distL1Ordered( &dataPoints[proposal.vantage[h]][0], &p[0], dim );
+      }
+    }
+
+    template <typename feature_t>
+    static inline ElectionStatus Elect( const std::vector<feature_t>& dataPoints,
+                                        int dim,
+                                        State& state,
+                                        const Proposal& proposal,
+                                        const double *stats,
+                                        splitter& judger,
+                                        Options& options,
+                                        int *label )
+    {
+      size_t H = proposal.vantage.size();
+      double bestScore = -1.0;
+      double th = 0.0;
+      size_t selected = 0;
+      std::vector<double> &distances = state.scratch->distances;
+      distances.resize( state.len );
+      for ( size_t h=0; h<H; h++ ) {
+        for ( size_t i=0; i<state.len; i++ ) {
+          distances[i] = stats[i * H + h];
+        }
+
+        double median = 0.0;
+        double score = 0.0;
+        if ( !evaluate( distances, options, median, score ) ) {
+          return CONVERGED;
+        }
+
+        if ( score > bestScore ) {
+          bestScore = score;
+          th = median;
+          selected = h;
+        }
+      }
+
+      judger.th = th;
+      judger.vantage.resize( dim );
+      for ( int j=0; j<dim; j++ ) {
+        judger.vantage[j] = dataPoints[proposal.vantage[selected]][j];
+      }
+      for ( size_t i=0; i<state.len; i++ ) {
+        label[i] = stats[i * H + selected] < th ? 0 : 1;
+      }
+      return SUCCESS;
+    }
+
+  private:
+
+    // Score the hypothesis whose distances to the data points of the
+    // node are @param distances (which get reordered): @param median
+    // is the threshold it suggests, and @param score the median
+    // absolute deviation of the distances around it. Return false if
+    // the data points have converged under it.
+    static inline bool evaluate( std::vector<double> &distances,
+                                 const Options& options,
+                                 double &median,
+                                 double &score )
+    {
+      double maxDist = *std::max_element( distances.begin(), distances.end() );
+        
+      if ( maxDist < options.converge ) {
+        return false;
+      }
+      // get median
+      size_t len = distances.size();
+      std::nth_element( distances.begin(), 
+                        distances.begin() + len / 2, 
+                        distances.end() );
+      median = distances[ len / 2 ];
+      // calculate score
+      for ( size_t i=0; i<len; i++ ) {
+        distances[i] = fabs( distances[i] - median );
+      }
+      std::nth_element( distances.begin(),
+                        distances.begin() + len / 2,
+                        distances.end() );
+      score = distances[ len / 2 ];
+      return true;
+    }
   };
   
 }
@@ -0,0 +1,165 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+// 
+// This file implements approximate k nearest neighbor search on top
+// of a forest of vantage point trees (kernel VP), under L1 distance:
+//
+// 1. The query descends every tree. At each internal node the
+//    distance d to the vantage point is computed, and the branch that
+//    is not taken is remembered with a lower bound |d - th| on the
+//    distance from the query to any point in it, which follows from
+//    the triangle inequality and the threshold th of the splitter.
+//
+// 2. The data points in the reached leaves are united, deduplicated
+//    and ranked by their exact L1 distances to the query.
+//
+// 3. Optionally, the remembered branches are then visited in the
+//    order of their lower bounds (backtracking), as long as the bound
+//    may still improve the current k-th distance and the budget on
+//    the number of distance evaluations is not exhausted.
+
+
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <unordered_set>
+#include <utility>
+#include <algorithm>
+#include "../tree/tree.hpp"
+#include "../kernels/VP.hpp"
+#include "../aux/Distance.hpp"
+
+namespace ran_forest
+{
+  template <typename dataType = float>
+  class NNSearch
+  {
+  private:
+    typedef typename Accumulator<dataType>::type acc_t;
+    
+    const Forest<dataType,VP> &forest;
+    // rows[i] points to the feature vector of data point i, as stored
+    // in the leaves of the forest
+    std::vector<const dataType*> rows;
+    int dim;
+
+  public:
+    struct Options
+    {
+      // the number of neighbors to return
+      size_t K;
+      // the maximum number of extra distance evaluations spent on
+      // backtracking, 0 for no backtracking
+      size_t budget;
+      
+      Options() : K(10), budget(0) {}
+    } options;
+
+    // Both @param forest and @param dataPoints, the data set from
+    // which the forest was grown (or into which it inserted), must
+    // outlive the search object.
+    template <typename feature_t>
+    NNSearch( const Forest<dataType,VP> &forest, const std::vector<feature_t> &dataPoints )
+      : forest(forest), rows( dataPoints.size() ), dim( forest.dimension() ), options()
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      for ( size_t i=0; i<dataPoints.size(); i++ ) {
+        rows[i] = &dataPoints[i][0];
+      }
+    }
+
+    // Return the (approximate) K nearest neighbors of @param p, as
+    // pairs of (data point ID, L1 distance) in ascending order of
+    // distance.
+    template <typename feature_t>
+    std::vector<std::pair<size_t,double> > search( const feature_t &p ) const
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      const dataType *q = &p[0];
+      
+      // the branches left behind, as (lower bound, node ID), nearest first
+      typedef std::pair<acc_t, size_t> branch_t;
+      std::priority_queue<branch_t, std::vector<branch_t>, std::greater<branch_t> > branches;
+      // the current top K, as (distance, data point ID), farthest first
+      std::priority_queue<std::pair<acc_t, size_t> > best;
+      std::unordered_set<size_t> seen;
+      size_t evals = 0;
+
+      for ( int t=0; t<forest.numTrees(); t++ ) {
+        descend( q, forest.treeRoot( t ), 0, branches, best, seen, evals );
+      }
+
+      size_t limit = evals + options.budget;
+      while ( !branches.empty() && evals < limit ) {
+        branch_t top = branches.top();
+        branches.pop();
+        if ( best.size() == options.K && top.first >= best.top().first ) break;
+        descend( q, top.second, top.first, branches, best, seen, evals );
+      }
+
+      std::vector<std::pair<size_t,double> > re( best.size() );
+      for ( size_t i=re.size(); i>0; i-- ) {
+        re[i-1] = std::make_pair( best.top().second, static_cast<double>( best.top().first ) );
+        best.pop();
+      }
+      return re;
+    }
+
+    // search() for every point of @param queries, in parallel.
+    template <typename feature_t>
+    std::vector<std::vector<std::pair<size_t,double> > > batchSearch( const std::vector<feature_t> &queries ) const
+    {
+      std::vector<std::vector<std::pair<size_t,double> > > re( queries.size() );
+#     pragma omp parallel for
+      for ( size_t i=0; i<queries.size(); i++ ) {
+        re[i] = search( queries[i] );
+      }
+      return re;
+    }
+
+  private:
+
+    // Follow the splitters from @param nodeID (whose lower bound is
+    // @param bound) down to a leaf, remember every branch not taken,
+    // and rank the unseen data points of the leaf.
+    template <typename branchQueue, typename bestQueue>
+    void descend( const dataType *q,
+                  size_t nodeID,
+                  acc_t bound,
+                  branchQueue &branches,
+                  bestQueue &best,
+                  std::unordered_set<size_t> &seen,
+                  size_t &evals ) const
+    {
+      while ( !forest.childrenView( nodeID ).empty() ) {
+        const BinaryOnDistance<dataType> &judge = forest.getJudge( nodeID );
+        const auto &children = forest.childrenView( nodeID );
+        // the branch is decided exactly as the splitter does, so that
+        // the first descent reaches the leaf Forest::query() reaches
+        double d = distL1Ordered( q, judge.vantage.data(), dim );
+        evals++;
+        acc_t gap = static_cast<acc_t>( std::fabs( d - judge.th ) );
+        int near = d < judge.th ? 0 : 1;
+        branches.push( std::make_pair( std::max( bound, gap ), children[1 - near] ) );
+        nodeID = children[near];
+      }
+
+      for ( auto& id : forest.storeView( nodeID ) ) {
+        if ( !seen.insert( id ).second ) continue;
+        acc_t d = distL1( q, rows[id], dim );
+        evals++;
+        if ( best.size() < options.K ) {
+          best.push( std::make_pair( d, id ) );
+        } else if ( d < best.top().first ) {
+          best.pop();
+          best.push( std::make_pair( d, id ) );
+        }
+      }
+    }
+  };
+}
@@ -0,0 +1,105 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+//
+// This file implements the class BinaryOnAxis, which is a binary
+// tree splitter that thresholds a single feature (axis) of the
+// feature vector. See splitters/BinaryOnDistance.hpp for the
+// description of splitters.
+
+
+#pragma once
+
+#include <string>
+#include <cmath>
+#include <type_traits>
+#include "LLPack/utils/extio.hpp"
+#include "../aux/Archive.hpp"
+#include "../tree/define.hpp"
+
+namespace ran_forest
+{
+  template <typename dataType>
+  class BinaryOnAxis
+  {
+  public:
+    static const std::string name;
+  public:
+    int axis;
+    double th;
+
+    // The default constructor
+    BinaryOnAxis() : axis(0), th(0.0) {}
+
+    inline void write( FILE *out ) const
+    {
+      fwrite( &axis, sizeof(int), 1, out );
+      fwrite( &th, sizeof(double), 1, out );
+    }
+
+    inline void read( FILE *in )
+    {
+      fread( &axis, sizeof(int), 1, in );
+      fread( &th, sizeof(double), 1, in );
+    }
+
+    inline void write( OutArchive &out ) const
+    {
+      out.put( axis );
+      out.put( th );
+    }
+
+    inline void read( InArchive &in )
+    {
+      in.get( axis );
+      in.get( th );
+    }
+
+    // The threshold is stored as is at FULL_PRECISION, and otherwise
+    // as a float rounded up, so that the feature values below it
+    // (which the threshold was placed above) stay below it. There is
+    // no feature vector to be stored.
+    inline void writeCompact( OutArchive &out, Precision precision ) const
+    {
+      out.putVarint( static_cast<uint64_t>( axis ) );
+      if ( FULL_PRECISION == precision ) {
+        out.put( th );
+        return;
+      }
+      float fth = static_cast<float>( th );
+      if ( fth < th ) fth = std::nextafter( fth, HUGE_VALF );
+      out.put( fth );
+    }
+
+    inline void readCompact( InArchive &in, Precision precision )
+    {
+      uint64_t value = 0;
+      in.getVarint( value );
+      axis = static_cast<int>( value );
+      if ( FULL_PRECISION == precision ) {
+        in.get( th );
+        return;
+      }
+      float fth = 0.0f;
+      in.get( fth );
+      th = fth;
+    }
+
+    template <typename feature_t>
+    inline int operator()( const feature_t& p ) const
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      if ( static_cast<double>( p[axis] ) < th ) return 0;
+      return 1;
+    }
+
+    inline bool operator==( const BinaryOnAxis<dataType>& other ) const
+    {
+      return axis == other.axis && th == other.th;
+    }
+  };
+  template <typename dataType>
+  const std::string BinaryOnAxis<dataType>::name = "Binary On Axis";
+}
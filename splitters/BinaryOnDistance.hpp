@@ -21,16 +21,32 @@
 // 1. a static constant string contains the name of the splitter
 // 2. a default constructor that takes no argument
 // 3. an operator== for equality comparison
-// 4. function write() and read() for serialization
+// 4. function write() and read() for serialization, each overloaded
+//    for a FILE* and for an archive (see aux/Archive.hpp), and
+//    writeCompact() and readCompact() for the compact format, which
+//    take the Precision (see tree/define.hpp) of feature values
 // 5. operator() as it is a functor
+//
+// and optionally a function bind( Arena* ) that places the storage of
+// the splitter (e.g. its vantage point) in an Arena (see
+// aux/Arena.hpp), which the forest calls before a splitter is elected.
 
 
 
 #pragma once
 
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
 #include "LLPack/utils/extio.hpp"
-#include "LLPack/algorithms/algebra.hpp"
+#include "../aux/Archive.hpp"
+#include "../aux/Arena.hpp"
+#include "../aux/Codec.hpp"
+#include "../aux/Distance.hpp"
+#include "../tree/define.hpp"
 
 namespace ran_forest
 {
@@ -41,29 +57,148 @@ namespace ran_forest
     static const std::string name;
   public:
     double th;
-    std::vector<dataType> vantage;
+    ArenaVector<dataType> vantage;
 
     // The default constructor
     BinaryOnDistance() : th(0.0), vantage() {}
 
-    // The move assignment, will be used in tree construction
-    const BinaryOnDistance<dataType>& operator==( BinaryOnDistance&& other )
+    // Moves hand over the vantage point (and the arena it is placed
+    // in) without copying it. Copies are placed on the heap, unless
+    // assigned to a splitter bound to an arena.
+    BinaryOnDistance( const BinaryOnDistance& other ) = default;
+    BinaryOnDistance( BinaryOnDistance&& other ) = default;
+    BinaryOnDistance& operator=( const BinaryOnDistance& other ) = default;
+    BinaryOnDistance& operator=( BinaryOnDistance&& other ) = default;
+
+    inline void bind( Arena *arena )
     {
-      th = other.th;
-      vantage.swap( other );
-      return *this;
+      ArenaVector<dataType>( ( ArenaAllocator<dataType>( arena ) ) ).swap( vantage );
     }
 
     inline void write( FILE *out ) const
     {
       fwrite( &th, sizeof(double), 1, out );
-      writeVector( out, vantage );
+      writeVector( out, std::vector<dataType>( vantage.begin(), vantage.end() ) );
     }
 
     inline void read( FILE *in )
     {
       fread( &th, sizeof(double), 1, in );
-      readVector( in, vantage );
+      std::vector<dataType> buffer;
+      readVector( in, buffer );
+      vantage.assign( buffer.begin(), buffer.end() );
+    }
+
+    inline void write( OutArchive &out ) const
+    {
+      out.put( th );
+      out.putVector( vantage );
+    }
+
+    inline void read( InArchive &in )
+    {
+      in.get( th );
+      in.getVector( vantage );
+    }
+
+    // The vantage point is stored in @param precision, and the
+    // threshold as is at FULL_PRECISION, which is lossless, and as a
+    // float otherwise. The float is rounded down, so that points
+    // exactly on the threshold (e.g. the median point it was taken
+    // from) still go to branch 1.
+    //
+    // A lossy precision moves the vantage point by its quantization
+    // error e, which changes the distance of a point to it by at most
+    // |e|_1, and typically by about |e|_2. The threshold is then also
+    // lowered by 2 |e|_2 before it is rounded, so that most points on
+    // it still go to branch 1, and points farther from it than
+    // |e|_1 + 2 |e|_2 keep their branch. Points closer than that to
+    // the threshold may take the other branch.
+    inline void writeCompact( OutArchive &out, Precision precision ) const
+    {
+      // the codes of the vantage point, and its squared error as
+      // readCompact() restores it
+      std::vector<uint16_t> halves;
+      std::vector<unsigned char> bytes;
+      float lo = 0.0f;
+      float scale = 0.0f;
+      double error = 0.0;
+      if ( HALF_PRECISION == precision ) {
+        halves.resize( vantage.size() );
+        for ( size_t j=0; j<vantage.size(); j++ ) {
+          halves[j] = floatToHalf( static_cast<float>( vantage[j] ) );
+          double e = static_cast<double>( vantage[j] ) - static_cast<double>( fromFloat( halfToFloat( halves[j] ) ) );
+          error += e * e;
+        }
+      } else if ( BYTE_PRECISION == precision ) {
+        lo = vantage.empty() ? 0.0f : static_cast<float>( *std::min_element( vantage.begin(), vantage.end() ) );
+        float hi = vantage.empty() ? 0.0f : static_cast<float>( *std::max_element( vantage.begin(), vantage.end() ) );
+        scale = ( hi > lo ) ? ( hi - lo ) / 255.0f : 0.0f;
+        bytes.resize( vantage.size() );
+        for ( size_t j=0; j<vantage.size(); j++ ) {
+          float q = ( scale > 0.0f ) ? std::round( ( static_cast<float>( vantage[j] ) - lo ) / scale ) : 0.0f;
+          bytes[j] = static_cast<unsigned char>( std::min( 255.0f, std::max( 0.0f, q ) ) );
+          double e = static_cast<double>( vantage[j] ) - static_cast<double>( fromFloat( lo + bytes[j] * scale ) );
+          error += e * e;
+        }
+      }
+
+      if ( FULL_PRECISION == precision ) {
+        out.put( th );
+      } else {
+        double lowered = th - 2.0 * std::sqrt( error );
+        float fth = static_cast<float>( lowered );
+        if ( fth > lowered ) fth = std::nextafter( fth, -HUGE_VALF );
+        out.put( fth );
+      }
+      out.putVarint( vantage.size() );
+      if ( HALF_PRECISION == precision ) {
+        for ( auto& half : halves ) out.put( half );
+      } else if ( BYTE_PRECISION == precision ) {
+        out.put( lo );
+        out.put( scale );
+        for ( auto& byte : bytes ) out.put( byte );
+      } else {
+        if ( !vantage.empty() ) out.write( &vantage[0], sizeof(dataType) * vantage.size() );
+      }
+    }
+
+    inline void readCompact( InArchive &in, Precision precision )
+    {
+      if ( FULL_PRECISION == precision ) {
+        in.get( th );
+      } else {
+        float value = 0.0f;
+        in.get( value );
+        th = value;
+      }
+      uint64_t len = 0;
+      in.getVarint( len );
+      if ( len > in.remain() ) {
+        // every element takes at least one byte
+        in.fail();
+        return;
+      }
+      vantage.resize( len );
+      if ( HALF_PRECISION == precision ) {
+        for ( auto& ele : vantage ) {
+          uint16_t half = 0;
+          in.get( half );
+          ele = fromFloat( halfToFloat( half ) );
+        }
+      } else if ( BYTE_PRECISION == precision ) {
+        float lo = 0.0f;
+        float scale = 0.0f;
+        in.get( lo );
+        in.get( scale );
+        for ( auto& ele : vantage ) {
+          unsigned char q = 0;
+          in.get( q );
+          ele = fromFloat( lo + q * scale );
+        }
+      } else {
+        if ( !vantage.empty() ) in.read( &vantage[0], sizeof(dataType) * vantage.size() );
+      }
     }
     
     template <typename feature_t>
@@ -71,11 +206,20 @@ namespace ran_forest
     {
       static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
                      "element of feature_t should have the same type as dataType." );
-      double dist = algebra::dist_l1( p, vantage, static_cast<int>( vantage.size() ) );
+      double dist = distL1Ordered( &p[0], vantage.data(), static_cast<int>( vantage.size() ) );
       if ( dist < th ) return 0;
       return 1;
     }
 
+  private:
+    // round to the nearest value for integral dataType
+    static inline dataType fromFloat( float value )
+    {
+      if ( std::is_integral<dataType>::value ) value = std::round( value );
+      return static_cast<dataType>( value );
+    }
+
+  public:
     inline bool operator==( const BinaryOnDistance<dataType>& other ) const 
     {
       if ( th != other.th ) return false;
@@ -0,0 +1,179 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+//
+// This file implements class LeafAffinity, which builds a sparse top-k
+// affinity graph (see aux/Affinity.hpp) over the data points stored in
+// the leaves of a forest, from leaf co-membership alone:
+//
+// 1. The affinity of points i and j is the fraction of the trees in
+//    which they share a leaf. Only the leaf stores are read, so any
+//    forest works, including forests read from files of any format
+//    and forests changed by insert(), and no data points are needed.
+//
+// 2. Optionally, only the points in the bag of each tree (see
+//    Forest::treeBag()) count as members of its leaves, which leaves
+//    out the points added by insert().
+//
+// 3. Every point is assigned its leaves through an index of 8 bytes
+//    per stored point and tree, each row is accumulated in a
+//    per-thread CountTable, and only the k largest affinities of each
+//    point are kept, so no dense N x N matrix is ever formed.
+
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include "tree.hpp"
+#include "../aux/Affinity.hpp"
+
+namespace ran_forest
+{
+  template <typename dataType = float, template <typename> class kernel = VP>
+  class LeafAffinity
+  {
+  private:
+    const Forest<dataType,kernel> &forest;
+
+  public:
+    struct Options
+    {
+      // the maximum number of neighbors of each point
+      size_t k;
+      // leaves holding more than maxLeafSize points (0 for no limit)
+      // are skipped, as the pairs within a leaf cost quadratic time
+      // while saying little about each of them; the weights remain
+      // fractions of all the trees
+      size_t maxLeafSize;
+      // whether only the points in the bag of each tree count, which
+      // requires the bags to be known
+      bool inBagOnly;
+
+      Options() : k(10), maxLeafSize(0), inBagOnly(false) {}
+    } options;
+
+    // @param forest must outlive the builder.
+    LeafAffinity( const Forest<dataType,kernel> &forest ) : forest( forest ), options() {}
+
+    // The graph linking every point to the (at most) options.k other
+    // points with the largest affinities, weighted by the affinity,
+    // with ties broken by the smaller point index. Its points are 0,
+    // ..., the largest ID in the leaf stores.
+    AffinityGraph topAffinity() const
+    {
+      size_t T = forest.numTrees();
+
+      // the members of leaf l (counted across the forest) are
+      // members[leafBegin[l]], ..., members[leafBegin[l + 1] - 1]
+      std::vector<size_t> leafBegin;
+      std::vector<uint32_t> members;
+      size_t N = 0;
+      std::vector<size_t> stack;
+      for ( size_t t=0; t<T; t++ ) {
+        const std::vector<uint64_t> &bag = forest.treeBag( static_cast<int>( t ) );
+        if ( options.inBagOnly && bag.empty() ) {
+          Error( "RanForest: the bag of tree %lu is unknown, as it was read from files written without it.", t );
+          exit( -1 );
+        }
+        stack.assign( 1, forest.treeRoot( static_cast<int>( t ) ) );
+        while ( !stack.empty() ) {
+          size_t nodeID = stack.back();
+          stack.pop_back();
+          const auto &children = forest.childrenView( nodeID );
+          for ( auto it=children.rbegin(); it!=children.rend(); it++ ) stack.push_back( *it );
+          if ( !children.empty() ) continue;
+          leafBegin.push_back( members.size() );
+          for ( auto& id : forest.storeView( nodeID ) ) {
+            if ( options.inBagOnly &&
+                 ( ( id >> 6 ) >= bag.size() || 0 == ( bag[id >> 6] & ( static_cast<uint64_t>( 1 ) << ( id & 63 ) ) ) ) ) {
+              continue;
+            }
+            if ( id >= std::numeric_limits<uint32_t>::max() ) {
+              Error( "RanForest: LeafAffinity supports fewer than 2^32 data points." );
+              exit( -1 );
+            }
+            members.push_back( static_cast<uint32_t>( id ) );
+            N = std::max( N, id + 1 );
+          }
+        }
+      }
+      size_t L = leafBegin.size();
+      leafBegin.push_back( members.size() );
+      if ( L >= std::numeric_limits<uint32_t>::max() ) {
+        Error( "RanForest: LeafAffinity supports fewer than 2^32 leaves." );
+        exit( -1 );
+      }
+
+      // the leaves of point i are leavesOf[pointBegin[i]], ...,
+      // leavesOf[pointBegin[i + 1] - 1] (counting sort)
+      std::vector<size_t> pointBegin( N + 1, 0 );
+      for ( auto& i : members ) pointBegin[i + 1]++;
+      for ( size_t i=0; i<N; i++ ) pointBegin[i + 1] += pointBegin[i];
+      std::vector<uint32_t> leavesOf( members.size() );
+      {
+        std::vector<size_t> cur( pointBegin.begin(), pointBegin.end() - 1 );
+        for ( size_t l=0; l<L; l++ ) {
+          for ( size_t e=leafBegin[l]; e<leafBegin[l + 1]; e++ ) {
+            leavesOf[cur[members[e]]++] = static_cast<uint32_t>( l );
+          }
+        }
+      }
+
+      size_t k = options.k;
+      size_t maxLeafSize = 0 == options.maxLeafSize ? std::numeric_limits<size_t>::max() : options.maxLeafSize;
+      float scale = 0 < T ? 1.0f / T : 0.0f;
+      // row i is first written to [i * k, i * k + degree[i])
+      std::vector<uint32_t> cols( N * k );
+      std::vector<float> weights( N * k );
+      std::vector<size_t> degree( N, 0 );
+#     pragma omp parallel
+      {
+        CountTable table;
+        std::vector<std::pair<uint32_t, uint32_t> > row;
+#       pragma omp for schedule(dynamic, 64)
+        for ( size_t i=0; i<N; i++ ) {
+          for ( size_t e=pointBegin[i]; e<pointBegin[i + 1]; e++ ) {
+            size_t l = leavesOf[e];
+            if ( leafBegin[l + 1] - leafBegin[l] > maxLeafSize ) continue;
+            for ( size_t m=leafBegin[l]; m<leafBegin[l + 1]; m++ ) {
+              if ( members[m] != i ) table.add( members[m] );
+            }
+          }
+          row.clear();
+          table.dump( row );
+          table.clear();
+          size_t d = std::min( k, row.size() );
+          // largest counts first, then smaller indices
+          auto before = []( const std::pair<uint32_t, uint32_t> &a, const std::pair<uint32_t, uint32_t> &b )
+            {
+              return a.second > b.second || ( a.second == b.second && a.first < b.first );
+            };
+          std::nth_element( row.begin(), row.begin() + d, row.end(), before );
+          std::sort( row.begin(), row.begin() + d );
+          for ( size_t e=0; e<d; e++ ) {
+            cols[i * k + e] = row[e].first;
+            weights[i * k + e] = row[e].second * scale;
+          }
+          degree[i] = d;
+        }
+      }
+
+      AffinityGraph graph;
+      graph.offsets.resize( N + 1 );
+      for ( size_t i=0; i<N; i++ ) graph.offsets[i + 1] = graph.offsets[i] + degree[i];
+      graph.cols.resize( graph.offsets[N] );
+      graph.weights.resize( graph.offsets[N] );
+      for ( size_t i=0; i<N; i++ ) {
+        std::copy( cols.begin() + i * k, cols.begin() + i * k + degree[i], graph.cols.begin() + graph.offsets[i] );
+        std::copy( weights.begin() + i * k, weights.begin() + i * k + degree[i],
+                   graph.weights.begin() + graph.offsets[i] );
+      }
+      return graph;
+    }
+  };
+}
@@ -0,0 +1,289 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+//
+// This file implements class BinaryForest, a read-only copy of a
+// forest of BinaryOnDistance splitters (e.g. kernel VP) laid out for
+// high throughput batched queries:
+//
+// 1. The vantage points of the internal nodes are packed row after
+//    row in a single buffer, next to an array of thresholds and an
+//    array holding the two links of each internal node.
+//
+// 2. Queries go through a tree in blocks of BLOCK at once. At each
+//    step every query of the block computes its distance to the
+//    vantage point of its current node, with the loop over the
+//    dimensions outside and the loop over the block inside, so that
+//    the vantage rows of BLOCK different nodes are loaded side by
+//    side. The next node is then link[2 * node + ( d >= th )], and
+//    queries that already reached their codeword are kept where they
+//    are by a select instead of a branch.
+//
+// Distances are accumulated in double in the order of the dimensions,
+// exactly as distL1Ordered() (see aux/Distance.hpp), which
+// BinaryOnDistance uses, so that every query reaches the same node as
+// Forest::queryTree().
+//
+// Codewords are numbered as in LevelForest (see level.hpp), densely
+// in breadth first order within each tree and tree after tree across
+// the forest.
+
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include "tree.hpp"
+#include "../aux/Distance.hpp"
+
+namespace ran_forest
+{
+  template <typename dataType = float>
+  class BinaryForest
+  {
+  public:
+    // the number of queries that go through a tree together
+    static const int BLOCK = 8;
+
+  private:
+    static const size_t LEAF = static_cast<size_t>( 1 ) << ( std::numeric_limits<size_t>::digits - 1 );
+
+    int dim;
+    int lv;
+    std::vector<size_t> roots;
+    std::vector<size_t> offsets;
+    // internal node i has threshold th[i], vantage point at
+    // vantages[i * dim], and children links[2 * i] and links[2 * i + 1]
+    std::vector<double> th;
+    std::vector<dataType> vantages;
+    std::vector<size_t> links;
+    std::vector<size_t> origin;
+
+  public:
+
+    BinaryForest() : dim(0), lv(-1), roots(), offsets( 1, 0 ), th(), vantages(), links(), origin() {}
+
+    // Copy the nodes of @param forest down to depth @param lv (-1 for
+    // the whole forest).
+    template <template <typename> class kernel>
+    BinaryForest( const Forest<dataType,kernel> &forest, int lv = -1 )
+      : dim( forest.dimension() ), lv( lv ), roots(), offsets(), th(), vantages(), links(), origin()
+    {
+      static_assert( std::is_same<typename kernel<dataType>::splitter, BinaryOnDistance<dataType> >::value,
+                     "BinaryForest requires BinaryOnDistance splitters." );
+      std::vector<size_t> queue;
+      for ( int t=0; t<forest.numTrees(); t++ ) {
+        offsets.push_back( origin.size() );
+        size_t base = th.size();
+        size_t code = 0;
+        queue.clear();
+        roots.push_back( link( forest, forest.treeRoot( t ), base, code, queue ) );
+        for ( size_t k=0; k<queue.size(); k++ ) {
+          const BinaryOnDistance<dataType> &judge = forest.getJudge( queue[k] );
+          const auto &children = forest.childrenView( queue[k] );
+          if ( 2 != children.size() || static_cast<int>( judge.vantage.size() ) != dim ) {
+            Error( "RanForest: BinaryForest requires binary nodes with %d dimensional vantage points.", dim );
+            exit( -1 );
+          }
+          th.push_back( judge.th );
+          vantages.insert( vantages.end(), judge.vantage.begin(), judge.vantage.end() );
+          for ( auto& c : children ) {
+            size_t l = link( forest, c, base, code, queue );
+            links.push_back( l );
+          }
+        }
+      }
+      offsets.push_back( origin.size() );
+    }
+
+  private:
+
+    template <template <typename> class kernel>
+    size_t link( const Forest<dataType,kernel> &forest, size_t i, size_t base, size_t &code,
+                 std::vector<size_t> &queue )
+    {
+      if ( forest.childrenView( i ).empty() || forest.getLevel( i ) == lv ) {
+        origin.push_back( i );
+        return LEAF | ( code++ );
+      }
+      queue.push_back( i );
+      return base + queue.size() - 1;
+    }
+
+  public:
+
+    // Return the codeword of @param p in tree @param treeID, local to
+    // the tree.
+    inline size_t queryTree( const dataType *p, int treeID ) const
+    {
+      size_t i = roots[treeID];
+      while ( !( i & LEAF ) ) {
+        double d = distL1Ordered( p, &vantages[i * dim], dim );
+        i = links[2 * i + ( d < th[i] ? 0 : 1 )];
+      }
+      return i & ~LEAF;
+    }
+
+    // Write the codewords of the @param n queries @param rows in tree
+    // @param treeID to @param out, one per query.
+    void queryBlock( const dataType* const *rows, size_t n, int treeID, size_t *out ) const
+    {
+#     define RANFOREST_CASE( D ) case D: queryBlockN<D>( rows, n, treeID, out ); return;
+      switch ( dim ) {
+        RANFOREST_FIXED_DIMS( RANFOREST_CASE )
+      default: queryBlockN<0>( rows, n, treeID, out );
+      }
+#     undef RANFOREST_CASE
+    }
+
+  private:
+
+    // queryBlock() over @tparam fixedDim dimensions (dim if 0). The
+    // distance of each query is accumulated one dimension after another
+    // exactly as distL1Ordered() does.
+    template <int fixedDim>
+    void queryBlockN( const dataType* const *rows, size_t n, int treeID, size_t *out ) const
+    {
+      const int m = 0 < fixedDim ? fixedDim : dim;
+      size_t node[BLOCK];
+      const dataType *q[BLOCK];
+      const dataType *v[BLOCK];
+      double d[BLOCK];
+      for ( size_t begin=0; begin<n; begin+=BLOCK ) {
+        // pad the last block with its first query
+        for ( int l=0; l<BLOCK; l++ ) {
+          q[l] = rows[( begin + l < n ) ? begin + l : begin];
+          node[l] = roots[treeID];
+        }
+        while ( true ) {
+          int active = 0;
+          for ( int l=0; l<BLOCK; l++ ) {
+            bool inner = !( node[l] & LEAF );
+            active += inner;
+            // lanes that are done keep computing on node 0
+            v[l] = vantages.data() + ( inner ? node[l] : 0 ) * m;
+            d[l] = 0.0;
+          }
+          if ( 0 == active ) break;
+          for ( int j=0; j<m; j++ ) {
+#           pragma omp simd
+            for ( int l=0; l<BLOCK; l++ ) {
+              d[l] += std::fabs( static_cast<double>( q[l][j] ) - static_cast<double>( v[l][j] ) );
+            }
+          }
+          for ( int l=0; l<BLOCK; l++ ) {
+            size_t i = node[l];
+            bool inner = !( i & LEAF );
+            size_t k = inner ? i : 0;
+            size_t next = links[2 * k + ( d[l] < th[k] ? 0 : 1 )];
+            node[l] = inner ? next : i;
+          }
+        }
+        for ( int l=0; l<BLOCK && begin + l < n; l++ ) {
+          out[begin + l] = node[l] & ~LEAF;
+        }
+      }
+    }
+
+  public:
+
+    template <typename feature_t>
+    std::vector<size_t> query( const feature_t& p ) const
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      std::vector<size_t> re( roots.size() );
+      for ( size_t t=0; t<roots.size(); t++ ) {
+        re[t] = queryTree( &p[0], static_cast<int>( t ) );
+      }
+      return re;
+    }
+
+    // Return the codewords of all the @param dataPoints in all the
+    // trees, where the codeword of point i in tree t is at
+    // [i * numTrees() + t].
+    template <typename feature_t>
+    std::vector<size_t> batchQuery( const std::vector<feature_t> &dataPoints ) const
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      if ( dataPoints.empty() ) return std::vector<size_t>();
+      if ( static_cast<int>( dataPoints[0].size() ) != dim ) {
+        Error( "RanForest: dimension does not match." );
+        exit( -1 );
+      }
+      std::vector<const dataType*> rows( dataPoints.size() );
+      for ( size_t i=0; i<dataPoints.size(); i++ ) {
+        rows[i] = &dataPoints[i][0];
+      }
+
+      // each task is a tile of points going through one tree
+      const size_t tile = 64 * BLOCK;
+      size_t T = roots.size();
+      size_t numTiles = ( rows.size() + tile - 1 ) / tile;
+      std::vector<size_t> re( rows.size() * T );
+#     pragma omp parallel
+      {
+        std::vector<size_t> codes( tile );
+#       pragma omp for schedule(dynamic)
+        for ( size_t task=0; task<numTiles * T; task++ ) {
+          size_t t = task % T;
+          size_t begin = ( task / T ) * tile;
+          size_t len = std::min( tile, rows.size() - begin );
+          queryBlock( &rows[begin], len, static_cast<int>( t ), &codes[0] );
+          for ( size_t i=0; i<len; i++ ) {
+            re[( begin + i ) * T + t] = codes[i];
+          }
+        }
+      }
+      return re;
+    }
+
+    // +-------------------------------------------------------------------------------
+    // Property Accessors
+
+    inline size_t column( int treeID, size_t code ) const
+    {
+      return offsets[treeID] + code;
+    }
+
+    inline size_t levelSize( int treeID ) const
+    {
+      return offsets[treeID + 1] - offsets[treeID];
+    }
+
+    inline size_t numColumns() const
+    {
+      return origin.size();
+    }
+
+    inline const std::vector<size_t>& collectLevel() const
+    {
+      return origin;
+    }
+
+    inline size_t originOf( size_t col ) const
+    {
+      return origin[col];
+    }
+
+    inline int numTrees() const
+    {
+      return static_cast<int>( roots.size() );
+    }
+
+    inline int dimension() const
+    {
+      return dim;
+    }
+
+    inline int depth() const
+    {
+      return lv;
+    }
+  };
+}
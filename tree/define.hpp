@@ -1,8 +1,25 @@
 #pragma once
 
+#include <cstddef>
+
 namespace ran_forest 
 {
-  enum SplittingOrder {BFS,DFS}; // Breadth First Splitting, Depth First Splitting
-  enum ElectionStatus { SUCCESS, NODE_SIZE_LIMIT_REACHED, CONVERGED, MAX_DEPTH_REACHED, NULL_HYPOTHESIS_SET };
+  // Breadth First Splitting, Depth First Splitting, and Level
+  // synchronous splitting, which splits all the nodes at the same
+  // depth together (requires the optional part of the kernel
+  // contract, see kernels/VP.hpp)
+  enum SplittingOrder {BFS,DFS,LEVEL};
+  enum ElectionStatus { SUCCESS, NODE_SIZE_LIMIT_REACHED, CONVERGED, MAX_DEPTH_REACHED, NULL_HYPOTHESIS_SET,
+                        MEMORY_LIMIT_REACHED };
+  // How feature values (e.g. vantage points) are stored by the compact
+  // serialization format: as is, as half precision floats, or as 8 bit
+  // values quantized between the minimum and maximum of each vector.
+  // The lossy ones can change the leaves points reach (see
+  // Forest::Format).
+  enum Precision { FULL_PRECISION, HALF_PRECISION, BYTE_PRECISION };
+
+  // node ID that refers to no node, e.g. a retired node in the
+  // remapping table returned by Forest::compact()
+  const size_t NULL_NODE = static_cast<size_t>( -1 );
 };
 
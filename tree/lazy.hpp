@@ -0,0 +1,287 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+// 
+// This file implements class LazyForest, a read-only view of a forest
+// written by Forest::write(), whose trees are loaded on demand:
+//
+// 1. Constructing a LazyForest only probes the tree files. A tree is
+//    read the first time it is queried.
+//
+// 2. A tree is made resident only as deep as it is needed. Queries
+//    stopping at level lv keep the nodes up to depth lv, and the leaf
+//    stores are kept only once getStore() is called on that tree. A
+//    tree needed deeper than it is resident is read again with all
+//    its levels.
+//
+// 3. The resident trees are charged for (an estimate of) the bytes
+//    they occupy. When the total exceeds the budget, the least
+//    recently used trees are dropped, to be read again when needed.
+//
+// Node IDs are local to each tree, numbered in breadth first order,
+// so that the nodes up to any depth always form a prefix of the IDs
+// and a node keeps its ID however deep its tree is resident.
+// 
+// All the public methods are safe to call from several threads. Each
+// tree has a lock of its own, so queries of resident trees only
+// contend with the queries of the same tree, and the lock of the whole
+// forest is only taken to load and evict trees.
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include "tree.hpp"
+
+namespace ran_forest
+{
+  template <typename dataType = float, template <typename> class kernel = VP>
+  class LazyForest
+  {
+  private:
+    typedef typename Forest<dataType,kernel>::Sapling Sapling;
+
+    struct Resident
+    {
+      std::shared_ptr<const Sapling> tree;
+      // the resident depth (-1 for all the levels), and whether the
+      // leaf stores are resident
+      int depth;
+      bool stores;
+      
+      Resident() : tree(), depth(0), stores(false) {}
+    };
+
+    std::string dir;
+    // set once, when the first tree is loaded
+    std::atomic<int> dim;
+    // trees[i] is guarded by treeLocks[i]
+    std::vector<Resident> trees;
+    std::unique_ptr<std::mutex[]> treeLocks;
+    // the clock tick of the last use of every tree
+    std::unique_ptr<std::atomic<uint64_t>[]> lastUse;
+    std::atomic<uint64_t> clock;
+    // the members below are guarded by lock, which is taken before
+    // any of treeLocks: the bytes charged for every tree (0 if it is
+    // not resident), and the budget on the resident bytes (0 for
+    // unlimited)
+    std::vector<size_t> bytes;
+    size_t budget;
+    size_t residentBytes;
+    std::mutex lock;
+    
+  public:
+    LazyForest( std::string dir, size_t budget = 0 )
+      : dir(dir), dim(-1), trees(), treeLocks(), lastUse(), clock(0), bytes(),
+        budget(budget), residentBytes(0)
+    {
+      int n = 0;
+      while ( probeFile( strf( "%s/tree.%d", dir.c_str(), n ) ) ) n++;
+      trees.resize( n );
+      treeLocks.reset( new std::mutex[n] );
+      lastUse.reset( new std::atomic<uint64_t>[n] );
+      for ( int i=0; i<n; i++ ) lastUse[i].store( 0 );
+      bytes.assign( n, 0 );
+    }
+
+    inline int numTrees() const
+    {
+      return static_cast<int>( trees.size() );
+    }
+
+    // The dimension of the feature vectors, which requires tree 0 to
+    // be loaded.
+    inline int dimension()
+    {
+      if ( -1 == dim.load() && !trees.empty() ) acquire( 0, 0, false );
+      return dim.load();
+    }
+
+    inline void setBudget( size_t bytes )
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      budget = bytes;
+      evict( -1 );
+    }
+
+    inline size_t memory()
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      return residentBytes;
+    }
+
+    // Load tree @param treeID ahead of its use, as deep as @param lv
+    // (-1 for all the levels), with its leaf stores if @param stores.
+    inline void prefetch( int treeID, int lv = -1, bool stores = false )
+    {
+      acquire( treeID, lv, stores );
+    }
+
+    // Same as Forest::queryTree(), but the returned node ID is local
+    // to tree @param treeID.
+    template <typename feature_t>
+    size_t queryTree( const feature_t& p, int treeID, int lv = -1 )
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      std::shared_ptr<const Sapling> tree = acquire( treeID, lv, false );
+      size_t i = 0;
+      while ( (!tree->child[i].empty()) && ( tree->level[i] != lv ) ) {
+        i = tree->child[i][tree->judge[i](p)];
+      }
+      return i;
+    }
+
+    template <typename feature_t>
+    std::vector<size_t> query( const feature_t& p, int lv = -1 )
+    {
+      std::vector<size_t> re( trees.size() );
+      for ( size_t i=0; i<trees.size(); i++ ) {
+        re[i] = queryTree( p, static_cast<int>( i ), lv );
+      }
+      return re;
+    }
+
+    // The data point IDs in leaf @param nodeID of tree @param treeID
+    inline std::vector<size_t> getStore( int treeID, size_t nodeID )
+    {
+      std::shared_ptr<const Sapling> tree = acquire( treeID, -1, true );
+      return std::vector<size_t>( tree->store[nodeID].begin(), tree->store[nodeID].end() );
+    }
+
+  private:
+
+    // Return tree @param treeID, making sure it is resident at least
+    // as deep as @param depth and with stores if @param stores.
+    std::shared_ptr<const Sapling> acquire( int treeID, int depth, bool stores )
+    {
+      // stores are only meaningful with all the leaves
+      if ( stores ) depth = -1;
+      lastUse[treeID].store( ++clock, std::memory_order_relaxed );
+      {
+        std::lock_guard<std::mutex> treeGuard( treeLocks[treeID] );
+        Resident &res = trees[treeID];
+        if ( covers( res, depth, stores ) ) return res.tree;
+        // a resident tree that is needed deeper (or with its stores) is
+        // loaded with all its levels, so that queries going deeper step
+        // by step read its file at most twice instead of once per step
+        if ( res.tree ) {
+          depth = -1;
+          stores = stores || res.stores;
+        }
+      }
+
+      // read outside the locks, so that the tree can still be queried
+      // as deep as it is resident, and other trees can be loaded
+      Sapling full;
+      int treeDim = 0;
+      if ( !Forest<dataType,kernel>::readTree( dir, treeID, full, treeDim ) ) {
+        Error( "RanForest: %s/tree.%d is corrupted or truncated.", dir.c_str(), treeID );
+        exit( -1 );
+      }
+      std::shared_ptr<Sapling> tree = std::make_shared<Sapling>();
+      truncate( full, depth, stores, *tree );
+      size_t treeBytes = footprint( *tree, treeDim );
+
+      std::lock_guard<std::mutex> guard( lock );
+      if ( -1 == dim.load() ) {
+        dim.store( treeDim );
+      } else if ( dim.load() != treeDim ) {
+        Error( "RanForest: dimension doesn't agree across trees." );
+        exit( -1 );
+      }
+      std::shared_ptr<const Sapling> re;
+      {
+        std::lock_guard<std::mutex> treeGuard( treeLocks[treeID] );
+        Resident &res = trees[treeID];
+        // another thread may have loaded it meanwhile
+        if ( !covers( res, depth, stores ) ) {
+          res.tree = tree;
+          res.depth = depth;
+          res.stores = stores;
+          residentBytes -= bytes[treeID];
+          bytes[treeID] = treeBytes;
+          residentBytes += treeBytes;
+        }
+        re = res.tree;
+      }
+      evict( treeID );
+      return re;
+    }
+
+    static inline bool covers( const Resident &res, int depth, bool stores )
+    {
+      if ( !res.tree ) return false;
+      if ( stores && !res.stores ) return false;
+      return -1 == res.depth || ( -1 != depth && depth <= res.depth );
+    }
+
+    // Drop least recently used trees other than @param keep until the
+    // budget is met. Must be called with the lock held.
+    void evict( int keep )
+    {
+      while ( 0 < budget && residentBytes > budget ) {
+        int victim = -1;
+        for ( int i=0; i<numTrees(); i++ ) {
+          if ( i == keep || 0 == bytes[i] ) continue;
+          if ( -1 == victim || lastUse[i].load() < lastUse[victim].load() ) victim = i;
+        }
+        if ( -1 == victim ) return;
+        {
+          std::lock_guard<std::mutex> treeGuard( treeLocks[victim] );
+          trees[victim] = Resident();
+        }
+        residentBytes -= bytes[victim];
+        bytes[victim] = 0;
+      }
+    }
+
+    // Copy the nodes of @param full up to depth @param depth (-1 for
+    // all) into @param out, renumbered in breadth first order. Nodes
+    // at depth become leaves without a splitter, and leaf stores are
+    // copied only if @param stores. The nodes are copied into the
+    // arena of @param out, so that @param full (and its arena) can be
+    // dropped afterwards.
+    static void truncate( Sapling &full, int depth, bool stores, Sapling &out )
+    {
+      std::vector<size_t> order( 1, 0 );
+      std::vector<size_t> newID( full.child.size(), 0 );
+      for ( size_t k=0; k<order.size(); k++ ) {
+        size_t i = order[k];
+        newID[i] = k;
+        if ( -1 != depth && full.level[i] >= depth ) continue;
+        for ( auto& c : full.child[i] ) order.push_back( c );
+      }
+      for ( size_t k=0; k<order.size(); k++ ) {
+        size_t i = order[k];
+        out.sprout( full.level[i] );
+        if ( ( -1 == depth || full.level[i] < depth ) && !full.child[i].empty() ) {
+          out.child[k].reserve( full.child[i].size() );
+          for ( auto& c : full.child[i] ) out.child[k].push_back( newID[c] );
+          out.judge[k] = full.judge[i];
+        }
+        if ( stores ) out.store[k] = full.store[i];
+      }
+    }
+
+    // An estimate of the bytes occupied by @param tree. Internal
+    // nodes are charged for a splitter holding @param treeDim elements,
+    // which is all that truncate() keeps splitters for.
+    static size_t footprint( const Sapling &tree, int treeDim )
+    {
+      size_t bytes = 0;
+      for ( size_t i=0; i<tree.child.size(); i++ ) {
+        bytes += sizeof(std::vector<size_t>) * 2 + sizeof(int) + sizeof(typename kernel<dataType>::splitter);
+        bytes += ( tree.child[i].size() + tree.store[i].size() ) * sizeof(size_t);
+        if ( !tree.child[i].empty() ) bytes += treeDim * sizeof(dataType);
+      }
+      return bytes;
+    }
+  };
+}
@@ -0,0 +1,200 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+//
+// This file implements class LevelForest, a compact read-only copy of
+// a forest truncated at a given depth, for using the forest as a
+// fixed-depth hierarchical quantizer.
+//
+// The nodes where Forest::queryTree( p, t, lv ) stops (the nodes at
+// depth lv, and the leaves above it) are the codewords. They are
+// numbered densely within each tree, in breadth first order, and
+// across the forest tree after tree, so that
+//
+//   column( t, code ) = offset of tree t + code
+//
+// enumerates all the codewords with no gaps. Only the internal nodes
+// above the level are kept, in flat arrays, and each link to a child
+// is either the index of an internal node or a codeword tagged with
+// LEAF.
+
+
+#pragma once
+
+#include <vector>
+#include <limits>
+#include "tree.hpp"
+#include "../aux/Bipartite.hpp"
+
+namespace ran_forest
+{
+  template <typename dataType = float, template <typename> class kernel = VP>
+  class LevelForest
+  {
+  private:
+    typedef typename kernel<dataType>::splitter splitter;
+
+    static const size_t LEAF = static_cast<size_t>( 1 ) << ( std::numeric_limits<size_t>::digits - 1 );
+
+    int dim;
+    int lv;
+    // the link to the root of each tree
+    std::vector<size_t> roots;
+    // the first codeword (column) of each tree, plus the total
+    std::vector<size_t> offsets;
+    // internal nodes: splitter, and the position of the first link in
+    // links[] to its children
+    std::vector<splitter> judge;
+    std::vector<size_t> first;
+    std::vector<size_t> links;
+    // the node ID in the original forest of each column
+    std::vector<size_t> origin;
+
+  public:
+
+    LevelForest() : dim(0), lv(-1), roots(), offsets( 1, 0 ), judge(), first(), links(), origin() {}
+
+    // Copy the nodes of @param forest down to depth @param lv (-1 for
+    // the whole forest).
+    LevelForest( const Forest<dataType,kernel> &forest, int lv = -1 )
+      : dim( forest.dimension() ), lv( lv ), roots(), offsets(), judge(), first(), links(), origin()
+    {
+      std::vector<size_t> queue;
+      for ( int t=0; t<forest.numTrees(); t++ ) {
+        offsets.push_back( origin.size() );
+        size_t base = judge.size();
+        size_t code = 0;
+        queue.clear();
+        roots.push_back( link( forest, forest.treeRoot( t ), base, code, queue ) );
+        // internal node queue[k] becomes judge[base + k]
+        for ( size_t k=0; k<queue.size(); k++ ) {
+          size_t i = queue[k];
+          judge.push_back( forest.getJudge( i ) );
+          first.push_back( links.size() );
+          for ( auto& c : forest.childrenView( i ) ) {
+            size_t l = link( forest, c, base, code, queue );
+            links.push_back( l );
+          }
+        }
+      }
+      offsets.push_back( origin.size() );
+    }
+
+  private:
+
+    // Return the link to node @param i of @param forest, which is
+    // either assigned the next codeword or queued as an internal node.
+    size_t link( const Forest<dataType,kernel> &forest, size_t i, size_t base, size_t &code,
+                 std::vector<size_t> &queue )
+    {
+      if ( forest.childrenView( i ).empty() || forest.getLevel( i ) == lv ) {
+        origin.push_back( i );
+        return LEAF | ( code++ );
+      }
+      queue.push_back( i );
+      return base + queue.size() - 1;
+    }
+
+  public:
+
+    // Return the codeword of @param p in tree @param treeID, local to
+    // the tree.
+    template <typename feature_t>
+    inline size_t queryTree( const feature_t& p, int treeID ) const
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      size_t i = roots[treeID];
+      while ( !( i & LEAF ) ) {
+        i = links[first[i] + judge[i](p)];
+      }
+      return i & ~LEAF;
+    }
+
+    template <typename feature_t>
+    std::vector<size_t> query( const feature_t& p ) const
+    {
+      std::vector<size_t> re( roots.size() );
+      for ( size_t t=0; t<roots.size(); t++ ) {
+        re[t] = queryTree( p, static_cast<int>( t ) );
+      }
+      return re;
+    }
+
+    // Same as Forest::batchQuery(), but the set B of the graph is the
+    // columns instead of the node IDs of the original forest.
+    template <typename feature_t>
+    Bipartite batchQuery( const std::vector<feature_t> &dataPoints ) const
+    {
+      if ( static_cast<int>( dataPoints[0].size() ) != dim ) {
+        Error( "RanForest: dimension does not match." );
+        exit( -1 );
+      }
+      double wt = 1.0 / numTrees();
+      std::vector<size_t> re( dataPoints.size() * roots.size() );
+#     pragma omp parallel for
+      for ( size_t i=0; i<dataPoints.size(); i++ ) {
+        for ( size_t t=0; t<roots.size(); t++ ) {
+          re[i * roots.size() + t] = offsets[t] + queryTree( dataPoints[i], static_cast<int>( t ) );
+        }
+      }
+
+      Bipartite graph( dataPoints.size(), numColumns() );
+      for ( size_t i=0; i<dataPoints.size(); i++ ) {
+        for ( size_t t=0; t<roots.size(); t++ ) {
+          graph.add( i, re[i * roots.size() + t], wt );
+        }
+      }
+      return graph;
+    }
+
+    // +-------------------------------------------------------------------------------
+    // Property Accessors
+
+    // The column of codeword @param code of tree @param treeID
+    inline size_t column( int treeID, size_t code ) const
+    {
+      return offsets[treeID] + code;
+    }
+
+    // Number of codewords in tree @param treeID
+    inline size_t levelSize( int treeID ) const
+    {
+      return offsets[treeID + 1] - offsets[treeID];
+    }
+
+    inline size_t numColumns() const
+    {
+      return origin.size();
+    }
+
+    // The node IDs in the original forest of all the columns, which
+    // is what Forest::collectLevel( lv ) returns, in column order.
+    inline const std::vector<size_t>& collectLevel() const
+    {
+      return origin;
+    }
+
+    // The node ID in the original forest of column @param col
+    inline size_t originOf( size_t col ) const
+    {
+      return origin[col];
+    }
+
+    inline int numTrees() const
+    {
+      return static_cast<int>( roots.size() );
+    }
+
+    inline int dimension() const
+    {
+      return dim;
+    }
+
+    inline int depth() const
+    {
+      return lv;
+    }
+  };
+}
@@ -0,0 +1,315 @@
+// This file is part of RanForest, a lightweight C++ template library
+// for random forest.
+//
+// By BreakDS <breakds@cs.wisc.edu> - http://www.unlicense.org/ (public domain)
+//
+// This file implements class OutOfBag, an index of the leaves that
+// the data points a forest was grown from fall into, used for out of
+// bag evaluation and forest proximities.
+//
+// The bag of each tree, the data point IDs it was grown from, is the
+// bitset the forest recorded when the tree was grown (see
+// Forest::treeBag()), and not the contents of its leaf stores, which
+// also hold the points added by Forest::insert(). Every point is then
+// assigned its leaf in every tree: read off the stores for the trees
+// that have it in their bags, and by going through the tree
+// otherwise. The index takes 8 bytes per point per tree (the leaf of
+// each point, and the points of each leaf), plus a bit per point per
+// tree for the bags, instead of the 32 bytes per edge of a Bipartite
+// from Forest::batchQuery().
+//
+// Proximities are computed row block after row block, where each row
+// only reads the leaves of its point, so that the memory in use is
+// the index plus the rows of one block. For a sparse top-k graph of
+// the points sharing leaves, which needs neither the bags nor the data
+// points, see LeafAffinity in tree/affinity.hpp.
+
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include "tree.hpp"
+
+namespace ran_forest
+{
+  template <typename dataType = float, template <typename> class kernel = VP>
+  class OutOfBag
+  {
+  private:
+    const Forest<dataType,kernel> *forest;
+    size_t N;
+    size_t T;
+    // bit i of bags[t * words, ...] is set if point i is in the bag of tree t
+    size_t words;
+    std::vector<uint64_t> bags;
+    // the leaves of tree t are leaves[leafBegin[t]], ...,
+    // leaves[leafBegin[t + 1] - 1], and their positions in this list
+    // are the (local) leaf codes of tree t
+    std::vector<size_t> leafBegin;
+    std::vector<size_t> leaves;
+    // the leaf code of point i in tree t is codes[t * N + i]
+    std::vector<uint32_t> codes;
+    // the points in leaf l (counted across the forest) are
+    // members[memberBegin[l]], ..., members[memberBegin[l + 1] - 1]
+    std::vector<size_t> memberBegin;
+    std::vector<uint32_t> members;
+
+  public:
+
+    // Index the leaves of @param forest that each of @param dataPoints
+    // falls into, where dataPoints are the data points (with the same
+    // IDs) the forest was grown from, possibly followed by others. The
+    // bags of all the trees must be known (see Forest::treeBag()). The
+    // forest must outlive the index and stay unchanged.
+    template <typename feature_t>
+    OutOfBag( const Forest<dataType,kernel> &forest, const std::vector<feature_t> &dataPoints )
+      : forest( &forest ), N( dataPoints.size() ), T( forest.numTrees() ), words( ( N + 63 ) / 64 ),
+        bags(), leafBegin(), leaves(), codes(), memberBegin(), members()
+    {
+      if ( N >= std::numeric_limits<uint32_t>::max() ) {
+        Error( "RanForest: OutOfBag supports fewer than 2^32 data points." );
+        exit( -1 );
+      }
+
+      // enumerate the leaves of each tree
+      std::vector<uint32_t> localCode( forest.numNodes(), 0 );
+      std::vector<size_t> stack;
+      for ( size_t t=0; t<T; t++ ) {
+        leafBegin.push_back( leaves.size() );
+        stack.assign( 1, forest.treeRoot( static_cast<int>( t ) ) );
+        while ( !stack.empty() ) {
+          size_t nodeID = stack.back();
+          stack.pop_back();
+          const auto &children = forest.childrenView( nodeID );
+          if ( children.empty() ) {
+            localCode[nodeID] = static_cast<uint32_t>( leaves.size() - leafBegin[t] );
+            leaves.push_back( nodeID );
+          }
+          for ( auto it=children.rbegin(); it!=children.rend(); it++ ) stack.push_back( *it );
+        }
+      }
+      leafBegin.push_back( leaves.size() );
+
+      bags.assign( T * words, 0 );
+      for ( size_t t=0; t<T; t++ ) {
+        const std::vector<uint64_t> &bag = forest.treeBag( static_cast<int>( t ) );
+        if ( bag.empty() ) {
+          Error( "RanForest: the bag of tree %lu is unknown, as it was read from files written without it.", t );
+          exit( -1 );
+        }
+        std::copy( bag.begin(), bag.begin() + std::min( bag.size(), words ), &bags[t * words] );
+      }
+      // the bits past point N - 1
+      if ( 0 != N % 64 ) {
+        for ( size_t t=0; t<T; t++ ) {
+          bags[t * words + words - 1] &= ( static_cast<uint64_t>( 1 ) << ( N % 64 ) ) - 1;
+        }
+      }
+
+      codes.resize( T * N );
+      memberBegin.resize( leaves.size() + 1 );
+      members.resize( T * N );
+#     pragma omp parallel for schedule(dynamic)
+      for ( size_t t=0; t<T; t++ ) {
+        const uint64_t *bag = &bags[t * words];
+        uint32_t *code = &codes[t * N];
+        // the stores also hold points inserted later, which are not
+        // in the bag and get queried below like the other ones
+        for ( size_t l=leafBegin[t]; l<leafBegin[t+1]; l++ ) {
+          for ( auto& id : forest.storeView( leaves[l] ) ) {
+            if ( id >= N || 0 == ( bag[id >> 6] & ( static_cast<uint64_t>( 1 ) << ( id & 63 ) ) ) ) continue;
+            code[id] = static_cast<uint32_t>( l - leafBegin[t] );
+          }
+        }
+        for ( size_t i=0; i<N; i++ ) {
+          if ( bag[i >> 6] & ( static_cast<uint64_t>( 1 ) << ( i & 63 ) ) ) continue;
+          code[i] = localCode[forest.queryTree( dataPoints[i], static_cast<int>( t ) )];
+        }
+
+        // group the points by leaf (counting sort)
+        size_t numLeaves = leafBegin[t+1] - leafBegin[t];
+        size_t *begin = &memberBegin[leafBegin[t]];
+        std::fill( begin, begin + numLeaves, 0 );
+        for ( size_t i=0; i<N; i++ ) begin[code[i]]++;
+        size_t pos = t * N;
+        for ( size_t c=0; c<numLeaves; c++ ) {
+          size_t count = begin[c];
+          begin[c] = pos;
+          pos += count;
+        }
+        std::vector<size_t> cur( begin, begin + numLeaves );
+        for ( size_t i=0; i<N; i++ ) members[cur[code[i]]++] = static_cast<uint32_t>( i );
+      }
+      memberBegin.back() = T * N;
+    }
+
+    // +-------------------------------------------------------------------------------
+    // Bags and Leaves
+
+    inline bool inBag( int treeID, size_t i ) const
+    {
+      return 0 != ( bags[treeID * words + ( i >> 6 )] & ( static_cast<uint64_t>( 1 ) << ( i & 63 ) ) );
+    }
+
+    // The number of trees that point @param i is out of the bag of.
+    inline size_t numOutOfBag( size_t i ) const
+    {
+      size_t re = 0;
+      for ( size_t t=0; t<T; t++ ) re += inBag( static_cast<int>( t ), i ) ? 0 : 1;
+      return re;
+    }
+
+    // The node ID of the leaf of tree @param treeID point @param i falls
+    // into.
+    inline size_t leafOf( int treeID, size_t i ) const
+    {
+      return leaves[leafBegin[treeID] + codes[treeID * N + i]];
+    }
+
+    // The points falling into the same leaf of tree @param treeID as
+    // point @param i, as [first, last).
+    inline std::pair<const uint32_t*, const uint32_t*> leafMates( int treeID, size_t i ) const
+    {
+      size_t l = leafBegin[treeID] + codes[treeID * N + i];
+      return std::make_pair( members.data() + memberBegin[l], members.data() + memberBegin[l + 1] );
+    }
+
+    inline size_t size() const
+    {
+      return N;
+    }
+
+    inline int numTrees() const
+    {
+      return static_cast<int>( T );
+    }
+
+    // +-------------------------------------------------------------------------------
+    // Out of Bag Evaluation
+
+    // Write the average of the leaf aggregates (see
+    // Forest::aggregate()) of point @param i over the trees it is out
+    // of the bag of into out[0], ..., out[aggregateWidth() - 1], and
+    // return the number of those trees (zeros for none).
+    size_t predict( size_t i, double *out ) const
+    {
+      size_t width = forest->aggregateWidth();
+      std::fill( out, out + width, 0.0 );
+      size_t count = 0;
+      for ( size_t t=0; t<T; t++ ) {
+        if ( inBag( static_cast<int>( t ), i ) ) continue;
+        const float *value = forest->leafAggregate( leafOf( static_cast<int>( t ), i ) );
+        for ( size_t k=0; k<width; k++ ) out[k] += value[k];
+        count++;
+      }
+      if ( 0 < count ) {
+        double scale = 1.0 / count;
+        for ( size_t k=0; k<width; k++ ) out[k] *= scale;
+      }
+      return count;
+    }
+
+    // The out of bag misclassification rate, with the forest
+    // aggregated by Forest::aggregateClasses() on the same @param
+    // labels. Points that are in the bags of all the trees are not
+    // counted.
+    double classError( const std::vector<int> &labels ) const
+    {
+      size_t width = forest->aggregateWidth();
+      size_t wrong = 0;
+      size_t counted = 0;
+#     pragma omp parallel reduction(+:wrong,counted)
+      {
+        std::vector<double> posterior( width );
+#       pragma omp for schedule(static)
+        for ( size_t i=0; i<N; i++ ) {
+          if ( 0 == predict( i, posterior.data() ) ) continue;
+          size_t best = std::max_element( posterior.begin(), posterior.end() ) - posterior.begin();
+          wrong += ( static_cast<int>( best ) != labels[i] ) ? 1 : 0;
+          counted++;
+        }
+      }
+      return 0 < counted ? static_cast<double>( wrong ) / counted : 0.0;
+    }
+
+    // The out of bag mean squared error, with the forest aggregated by
+    // Forest::aggregateMean() on the same @param targets.
+    double squaredError( const std::vector<double> &targets ) const
+    {
+      if ( 1 != forest->aggregateWidth() ) {
+        Error( "RanForest: squaredError() requires aggregates of width 1, see Forest::aggregateMean()." );
+        exit( -1 );
+      }
+      double sum = 0.0;
+      size_t counted = 0;
+#     pragma omp parallel for schedule(static) reduction(+:sum,counted)
+      for ( size_t i=0; i<N; i++ ) {
+        double value = 0.0;
+        if ( 0 == predict( i, &value ) ) continue;
+        sum += ( value - targets[i] ) * ( value - targets[i] );
+        counted++;
+      }
+      return 0 < counted ? sum / counted : 0.0;
+    }
+
+    // +-------------------------------------------------------------------------------
+    // Proximities
+
+    // Compute the forest proximities of the points [@param begin,
+    // @param end) to all the points, where the proximity of i and j is
+    // the fraction of the trees in which they fall into the same leaf
+    // (1 for i itself). @param visit( i, row ) is called on the rows in
+    // order from the calling thread, where row lists the (j, proximity)
+    // of the points j with a non-zero proximity in ascending j.
+    //
+    // Rows are computed in parallel in blocks of @param blockSize,
+    // each thread counting in an array of N integers.
+    template <typename visit_t>
+    void proximity( visit_t visit, size_t begin = 0, size_t end = std::numeric_limits<size_t>::max(),
+                    size_t blockSize = 4096 ) const
+    {
+      end = std::min( end, N );
+      blockSize = std::max<size_t>( 1, blockSize );
+      float scale = 1.0f / T;
+      std::vector<std::vector<std::pair<size_t, float> > > rows( blockSize );
+#     pragma omp parallel
+      {
+        std::vector<uint32_t> hits( N, 0 );
+        std::vector<uint32_t> touched;
+        for ( size_t first=begin; first<end; first+=blockSize ) {
+          size_t last = std::min( end, first + blockSize );
+#         pragma omp for schedule(dynamic)
+          for ( size_t i=first; i<last; i++ ) {
+            touched.clear();
+            for ( size_t t=0; t<T; t++ ) {
+              auto mates = leafMates( static_cast<int>( t ), i );
+              for ( const uint32_t *j=mates.first; j<mates.second; j++ ) {
+                if ( 0 == hits[*j]++ ) touched.push_back( *j );
+              }
+            }
+            std::sort( touched.begin(), touched.end() );
+            auto &row = rows[i - first];
+            row.clear();
+            for ( auto& j : touched ) {
+              row.push_back( std::make_pair( static_cast<size_t>( j ), hits[j] * scale ) );
+              hits[j] = 0;
+            }
+          }
+          // the rows of the block are complete after the implicit
+          // barrier above, and are consumed before the next block
+#         pragma omp master
+          {
+            for ( size_t i=first; i<last; i++ ) {
+              visit( i, static_cast<const std::vector<std::pair<size_t, float> >&>( rows[i - first] ) );
+            }
+          }
+#         pragma omp barrier
+        }
+      }
+    }
+  };
+}
@@ -13,11 +13,22 @@
 
 #include <cassert>
 #include <type_traits>
-#include <deque>
 #include <functional>
 #include <cstring>
+#include <numeric>
+#include <algorithm>
+#include <memory>
+#include <future>
+#include <atomic>
 #include "../kernels/VP.hpp"
 #include "../aux/Bipartite.hpp"
+#include "../aux/ThreadPool.hpp"
+#include "../aux/Sampling.hpp"
+#include "../aux/Archive.hpp"
+#include "../aux/Arena.hpp"
+#include "../aux/Codec.hpp"
+#include "../aux/Transport.hpp"
+#include "../aux/Worklist.hpp"
 
 
 namespace ran_forest
@@ -47,53 +58,153 @@ namespace ran_forest
   // i is not a leaf.
   // 7. roots[t] stores the node ID of the root of tree t.
   // 8. as an aux data structure, level[i] stores the depth of node i,
-  // with root having a depth of 0.
+  // with root having a depth of 0. Nodes of trees that have been
+  // dropped (see fell()) have a level of -1 until compact() is called.
+  // 9. child[i], store[i] and the storage of judge[i] are placed in
+  // arenas (see aux/Arena.hpp), one per tree grown or read, which the
+  // forest owns and releases as a whole. Space in the arenas freed by
+  // retired nodes, or left behind by leaf stores that insert() grew,
+  // is reclaimed by compact().
+  // 10. bags[t] is the bag of tree t, the set of the data point IDs it
+  // was grown from, as a bitset. It is kept apart from the leaf
+  // stores, which also receive the points added by insert().
   template <typename dataType = float, template <typename> class kernel = VP>
   class Forest
   {
+    // reuses the tree file decoders, see tree/lazy.hpp
+    template <typename, template <typename> class> friend class LazyForest;
+
+  public:
+    // the type of the child lists and leaf stores
+    typedef ArenaVector<size_t> IDList;
+    
   private:
     // dimension of the feature vectors
     int dim;
     // for the member variables below, see class description above
     std::vector<size_t> roots; 
-    std::vector<std::vector<size_t> > child; 
+    std::vector<IDList> child; 
     std::vector<typename kernel<dataType>::splitter> judge;
     std::vector<int> level;
-    std::vector<std::vector<size_t> > store; 
+    std::vector<IDList> store; 
+    std::vector<std::shared_ptr<Arena> > arenas;
+    // whether insert() left outgrown leaf stores in the arenas
+    bool slack;
+    // bit i of bags[t][i / 64] is set if data point i is in the bag of
+    // tree t, and bags[t] is empty if the bag is unknown (trees read
+    // from files written without it)
+    std::vector<std::vector<uint64_t> > bags;
+    // persistent workers serving asynchronous queries, see attachPool()
+    std::shared_ptr<ThreadPool> pool;
+    // every tree grown gets its own random stream (randomSeed, n),
+    // where n is the number of streams handed out before it
+    uint64_t randomSeed;
+    uint64_t numStreams;
+    // optional per leaf aggregates (see aggregate()): leaf i owns
+    // aggregates[leafSlot[i] * aggWidth, ... + aggWidth), and
+    // leafSlot[i] is NULL_NODE for internal nodes. leafSlot is
+    // emptied whenever the leaves change.
+    size_t aggWidth;
+    std::vector<size_t> leafSlot;
+    std::vector<float> aggregates;
+    // memory accounting of growth, see setMemoryBudget()
+    struct Budget
+    {
+      size_t limit;
+      std::atomic<size_t> used;
+      std::atomic<size_t> capped;
+      Budget() : limit(0), used(0), capped(0) {}
+    };
+    std::shared_ptr<Budget> budget;
+
+    // A sapling is a tree (or a subtree) grown on its own, with node
+    // IDs local to it, before it is grafted into the forest. Trees
+    // being grown in parallel therefore share no state, and the final
+    // node IDs do not depend on the scheduling of the threads.
+    struct Sapling
+    {
+      std::vector<IDList> child; 
+      std::vector<typename kernel<dataType>::splitter> judge;
+      std::vector<int> level;
+      std::vector<IDList> store; 
+      // holds the child lists, stores and splitters of the sapling
+      std::shared_ptr<Arena> arena;
+
+      Sapling() : child(), judge(), level(), store(), arena( std::make_shared<Arena>() ) {}
+
+      // add a node at depth @param depth, and return its local ID
+      inline size_t sprout( int depth )
+      {
+        size_t id = child.size();
+        child.emplace_back( ArenaAllocator<size_t>( arena.get() ) );
+        judge.emplace_back();
+        bindArena( judge.back(), arena.get(), 0 );
+        level.push_back( depth );
+        store.emplace_back( ArenaAllocator<size_t>( arena.get() ) );
+        return id;
+      }
+
+      inline void swap( Sapling &other )
+      {
+        child.swap( other.child );
+        judge.swap( other.judge );
+        level.swap( other.level );
+        store.swap( other.store );
+        arena.swap( other.arena );
+      }
+    };
     
 
 
   private:
-    // The set of functions below operate on deques. Breadth First
-    // Search (BFS) pushes to the back of the deque and pops from the
-    // front of the deque. Depth First Search (DFS) pushes to the back
-    // of the deque as well but also pops from the back. Here fetch
+    // The set of functions below operate on worklists (see
+    // aux/Worklist.hpp). Breadth First Search (BFS) pushes to the back
+    // of the worklist and pops from the front of the worklist. Depth
+    // First Search (DFS) pushes to the back of the worklist as well but
+    // also pops from the back. Here fetch
     // and pop are specialized for BFS and DFS, respectively.
     template <SplittingOrder order, typename T>
-    inline T& fetch( std::deque<T> &q, ENABLE_IF(BFS==order) )
+    inline T& fetch( Worklist<T> &q, ENABLE_IF(BFS==order) )
     {
       return q.front();
     }
     template <SplittingOrder order, typename T>
-    inline T& fetch( std::deque<T> &q, ENABLE_IF(DFS==order) )
+    inline T& fetch( Worklist<T> &q, ENABLE_IF(DFS==order) )
     {
       return q.back();
     }
     template <SplittingOrder order, typename T>
-    inline void pop( std::deque<T> &q, ENABLE_IF(BFS==order) )
+    inline void pop( Worklist<T> &q, ENABLE_IF(BFS==order) )
     {
       q.pop_front();
     }
     template <SplittingOrder order, typename T>
-    inline void pop( std::deque<T> &q, ENABLE_IF(DFS==order) )
+    inline void pop( Worklist<T> &q, ENABLE_IF(DFS==order) )
     {
       q.pop_back();
     }
+    // and the versions where the end is chosen at run time
+    template <typename T>
+    inline T& fetch( Worklist<T> &q, bool back )
+    {
+      return back ? q.back() : q.front();
+    }
+    template <typename T>
+    inline void pop( Worklist<T> &q, bool back )
+    {
+      if ( back ) {
+        q.pop_back();
+      } else {
+        q.pop_front();
+      }
+    }
     
   public:
     
     // the default constructor
-    Forest() : dim(0), roots(), child(), judge(), store() {}
+    Forest() : dim(0), roots(), child(), judge(), level(), store(), arenas(), slack(false), bags(), pool(),
+               randomSeed(0), numStreams(0),
+               aggWidth(0), leafSlot(), aggregates(), budget( std::make_shared<Budget>() ) {}
 
     template <SplittingOrder order = DFS,
               typename feature_t>
@@ -103,36 +214,67 @@ namespace ran_forest
                typename kernel<dataType>::Options options,
                bool silent = false )
     {
-
-      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
-                     "element of feature_t should have the same type as dataType." );
-
       roots.clear();
       child.clear();
       judge.clear();
       level.clear();
       store.clear();
+      arenas.clear();
+      slack = false;
+      bags.clear();
       
-
       dim = dataDim;
+      numStreams = 0;
 
-      size_t len = dataPoints.size();
-      size_t lenPerTree = len;
-      if ( options.proportion < 1.0 ) 
-        lenPerTree = static_cast<size_t>( len * options.proportion );
+      plant<order>( n, dataPoints, options, silent );
+    }
+
+    // Set the seed from which the random streams of all the trees
+    // grown afterwards are derived. Growing the same data with the
+    // same seed and options yields the same forest regardless of the
+    // number of threads.
+    inline void setRandomSeed( uint64_t seed )
+    {
+      randomSeed = seed;
+    }
 
+    // Grow @param n additional trees into the forest, keeping all the
+    // existing trees and node IDs intact. The new trees get the tree
+    // IDs numTrees(), ..., numTrees() + n - 1.
+    template <SplittingOrder order = DFS,
+              typename feature_t>
+    void plant( int n,
+                const std::vector<feature_t>& dataPoints,
+                typename kernel<dataType>::Options options,
+                bool silent = false )
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
 
-      roots.resize( n );
+      checkDimension( dataPoints );
+      dropAggregates();
+      resetBudget();
+      size_t base = roots.size();
+      roots.resize( base + n );
+      bags.resize( base + n );
       std::vector<std::vector<size_t> > idx(n);
-      
+      uint64_t stream = numStreams;
+      numStreams += n;
       
       ProgressBar progressbar;
       progressbar.reset( n );
       int complete = 0;
+      std::vector<Sapling> saplings(n);
 #     pragma omp parallel for
       for ( int i=0; i<n; i++ ) {
-        idx[i] = rndgen::randperm( len, lenPerTree );
-        roots[i] = seed( dataPoints, idx[i], options );
+        RandomStream rng( randomSeed, stream + i );
+        idx[i] = bootstrap( rng, dataPoints.size(), options.proportion );
+        bags[base + i] = bagOf( idx[i], dataPoints.size() );
+        charge( idx[i].size() * sizeof(size_t) );
+        nurture<order>( saplings[i], dataPoints, idx[i], options, rng );
+        // the leaf stores hold their own copies
+        release( idx[i].size() * sizeof(size_t) );
+        std::vector<size_t>().swap( idx[i] );
 #       pragma omp critical
         {
           if ( !silent ) {
@@ -140,249 +282,1270 @@ namespace ran_forest
           }
         }
       }
+
+      // graft in the order of tree IDs so that node IDs do not depend
+      // on which thread finished first
+      for ( int i=0; i<n; i++ ) {
+        roots[base + i] = graft( saplings[i] );
+        Sapling().swap( saplings[i] );
+      }
+
+      if ( !silent && 0 < cappedNodes() ) {
+        Info( "RanForest: memory budget reached, %lu nodes were kept as leaves.", cappedNodes() );
+      }
     }
-    
 
+    // Regrow tree @param treeID from @param dataPoints. The nodes of
+    // the old tree are retired (see fell()), and the new tree takes
+    // over the same tree ID.
+    template <SplittingOrder order = DFS,
+              typename feature_t>
+    void replant( int treeID,
+                  const std::vector<feature_t>& dataPoints,
+                  typename kernel<dataType>::Options options )
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      assert( treeID < numTrees() );
+      checkDimension( dataPoints );
+      dropAggregates();
+      retire( roots[treeID] );
+      resetBudget();
+      RandomStream rng( randomSeed, numStreams++ );
+      std::vector<size_t> idx = bootstrap( rng, dataPoints.size(), options.proportion );
+      bags[treeID] = bagOf( idx, dataPoints.size() );
+      roots[treeID] = seed<order>( dataPoints, idx, options, rng );
+    }
+
+    // Drop tree @param treeID from the forest. Trees after it shift
+    // down by one tree ID. The nodes of the dropped tree are retired
+    // but keep occupying their node IDs, so that the node IDs of all
+    // the other trees stay valid until compact() is called.
+    void fell( int treeID )
+    {
+      assert( treeID < numTrees() );
+      dropAggregates();
+      retire( roots[treeID] );
+      roots.erase( roots.begin() + treeID );
+      bags.erase( bags.begin() + treeID );
+    }
+
+    // Renumber the nodes so that the retired ones are squeezed
+    // out. Relative order of the surviving node IDs is preserved. The
+    // returned remapping table maps every old node ID to its new node
+    // ID, or to NULL_NODE if the old node was retired, and should be
+    // applied to any structure (e.g. Bipartite, TMeanShell centers)
+    // built on the old node IDs.
+    //
+    // The surviving nodes are copied into fresh arenas, one per tree,
+    // which releases the memory of the retired nodes and of the leaf
+    // stores outgrown by insert(). Without either, nothing is copied.
+    std::vector<size_t> compact()
+    {
+      std::vector<size_t> remap( child.size(), NULL_NODE );
+      size_t count = 0;
+      for ( size_t i=0; i<child.size(); i++ ) {
+        if ( 0 <= level[i] ) remap[i] = count++;
+      }
+      if ( count == child.size() && !slack ) return remap;
+
+      // every tree gets an arena of its own again, so that trees do
+      // not contend for an arena when they are changed in parallel
+      // (e.g. by insert()), and nodes no tree reaches share one more
+      std::vector<size_t> owner( child.size(), roots.size() );
+      std::vector<size_t> stack;
+      for ( size_t t=0; t<roots.size(); t++ ) {
+        stack.assign( 1, roots[t] );
+        while ( !stack.empty() ) {
+          size_t nodeID = stack.back();
+          stack.pop_back();
+          owner[nodeID] = t;
+          for ( auto& c : child[nodeID] ) stack.push_back( c );
+        }
+      }
+      std::vector<std::shared_ptr<Arena> > newArenas( roots.size() + 1 );
+      for ( auto& arena : newArenas ) arena = std::make_shared<Arena>();
+      std::vector<IDList> newChild;
+      std::vector<typename kernel<dataType>::splitter> newJudge( count );
+      std::vector<int> newLevel( count );
+      std::vector<IDList> newStore;
+      newChild.reserve( count );
+      newStore.reserve( count );
+      for ( size_t i=0; i<child.size(); i++ ) {
+        if ( NULL_NODE == remap[i] ) continue;
+        size_t j = remap[i];
+        Arena *arena = newArenas[owner[i]].get();
+        newChild.emplace_back( ArenaAllocator<size_t>( arena ) );
+        newStore.emplace_back( ArenaAllocator<size_t>( arena ) );
+        newChild[j].reserve( child[i].size() );
+        for ( auto& c : child[i] ) newChild[j].push_back( remap[c] );
+        bindArena( newJudge[j], arena, 0 );
+        newJudge[j] = judge[i];
+        newLevel[j] = level[i];
+        newStore[j] = store[i];
+      }
+      for ( auto& root : roots ) root = remap[root];
+      if ( leafSlot.size() == child.size() ) {
+        std::vector<size_t> newSlot( count );
+        for ( size_t i=0; i<child.size(); i++ ) {
+          if ( NULL_NODE != remap[i] ) newSlot[remap[i]] = leafSlot[i];
+        }
+        leafSlot.swap( newSlot );
+      }
+      
+      child.swap( newChild );
+      judge.swap( newJudge );
+      level.swap( newLevel );
+      store.swap( newStore );
+      arenas.swap( newArenas );
+      slack = false;
+      return remap;
+    }
+
+    // Insert the data points @param ids into the leaf stores of every
+    // tree without growing the forest again. @param dataPoints is the
+    // whole data set indexed by data point ID, i.e. it contains both
+    // the points the forest was grown from and the new ones. Trees are
+    // processed in parallel as each of them owns its own leaves.
+    //
+    // When @param resplit is positive, every leaf that ends up holding
+    // more than resplit * options.stopNum points is split again, by
+    // running the kernel's ElectSplitter on that leaf only.
+    //
+    // Each leaf store receiving points is reallocated once per call,
+    // and its old copy stays in its arena until compact() is called.
+    template <SplittingOrder order = DFS,
+              typename feature_t>
+    void insert( const std::vector<feature_t>& dataPoints,
+                 const std::vector<size_t>& ids,
+                 typename kernel<dataType>::Options options,
+                 double resplit = 0.0 )
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      int n = numTrees();
+      std::vector<std::vector<size_t> > touched( n );
+      dropAggregates();
+      resetBudget();
+      
+#     pragma omp parallel for
+      for ( int t=0; t<n; t++ ) {
+        // (leaf, ID) in the order of ids within every leaf, so that
+        // each store grows only once
+        std::vector<std::pair<size_t, size_t> > landed( ids.size() );
+        for ( size_t k=0; k<ids.size(); k++ ) {
+          landed[k] = std::make_pair( queryTree( dataPoints[ids[k]], t ), ids[k] );
+        }
+        std::stable_sort( landed.begin(), landed.end(),
+                          []( const std::pair<size_t, size_t> &a, const std::pair<size_t, size_t> &b )
+                          {
+                            return a.first < b.first;
+                          } );
+        for ( size_t k=0; k<landed.size(); ) {
+          size_t leaf = landed[k].first;
+          size_t end = k;
+          while ( end < landed.size() && landed[end].first == leaf ) end++;
+          store[leaf].reserve( store[leaf].size() + end - k );
+          for ( ; k<end; k++ ) store[leaf].push_back( landed[k].second );
+          touched[t].push_back( leaf );
+        }
+      }
+      slack = slack || !ids.empty();
+
+      if ( resplit <= 0.0 ) return;
+      size_t limit = static_cast<size_t>( resplit * options.stopNum );
+      uint64_t stream = numStreams;
+      numStreams += n;
+
+      std::vector<std::vector<std::pair<size_t, Sapling> > > saplings( n );
+#     pragma omp parallel for
+      for ( int t=0; t<n; t++ ) {
+        RandomStream rng( randomSeed, stream + t );
+        for ( auto& leaf : touched[t] ) {
+          if ( store[leaf].size() <= limit ) continue;
+          saplings[t].emplace_back( leaf, Sapling() );
+          Sapling &sapling = saplings[t].back().second;
+          sapling.sprout( level[leaf] );
+          typename kernel<dataType>::State state( &store[leaf][0], store[leaf].size(), options );
+          state.depth = level[leaf];
+          expand<order>( sapling, dataPoints, 0, std::move( state ), options, rng );
+        }
+      }
+
+      for ( int t=0; t<n; t++ ) {
+        for ( auto& ele : saplings[t] ) {
+          graft( ele.second, ele.first );
+        }
+      }
+    }
+
+  private:
+
+    // Release the contents of all the nodes in the subtree rooted at
+    // @param root, and mark them as retired with a level of -1.
+    void retire( size_t root )
+    {
+      std::vector<size_t> stack( 1, root );
+      while ( !stack.empty() ) {
+        size_t nodeID = stack.back();
+        stack.pop_back();
+        for ( auto& c : child[nodeID] ) stack.push_back( c );
+        IDList().swap( child[nodeID] );
+        IDList().swap( store[nodeID] );
+        judge[nodeID] = typename kernel<dataType>::splitter();
+        level[nodeID] = -1;
+      }
+    }
 
+  public:
+    
     /* grow one tree, return the nodeID of the root */
     template <SplittingOrder order = DFS,
               typename feature_t>
     size_t seed( const std::vector<feature_t>& dataPoints,
                  std::vector<size_t> &idx,
-                 typename kernel<dataType>::Options options )
+                 typename kernel<dataType>::Options options,
+                 RandomStream &rng )
     {
       static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
                      "element of feature_t should have the same type as dataType." );
-      std::deque<std::pair<size_t,typename kernel<dataType>::State> > worklist;
-      
+      Sapling sapling;
+      nurture<order>( sapling, dataPoints, idx, options, rng );
       size_t root = 0;
 #     pragma omp critical
-      {
-        root = child.size();
-        child.emplace_back();
-        judge.emplace_back();
-        store.emplace_back();
-        level.emplace_back( 0 );
+      root = graft( sapling );
+      return root;
+    }
+
+  private:
+
+    // Exit unless @param dataPoints have the dimension of the forest.
+    // The dimension is taken from the data only when neither grow()
+    // nor an earlier tree has set it.
+    template <typename feature_t>
+    void checkDimension( const std::vector<feature_t>& dataPoints )
+    {
+      if ( dim <= 0 && !dataPoints.empty() ) {
+        dim = static_cast<int>( dataPoints[0].size() );
+      }
+      if ( !dataPoints.empty() && static_cast<int>( dataPoints[0].size() ) != dim ) {
+        Error( "RanForest: dimension does not match." );
+        exit( -1 );
+      }
+    }
+
+    // Draw the data points a tree is grown from: a @param proportion
+    // of the @param len data points without replacement, or all of
+    // them if proportion is not below 1. The indices come out sorted,
+    // so that the root of the tree scans the data sequentially.
+    static std::vector<size_t> bootstrap( RandomStream &rng, size_t len, double proportion )
+    {
+      if ( proportion < 1.0 ) {
+        return sortedSample( rng, len, static_cast<size_t>( len * proportion ) );
+      }
+      std::vector<size_t> idx( len );
+      std::iota( idx.begin(), idx.end(), 0 );
+      return idx;
+    }
+
+    // The bitset of the data point IDs @param idx, drawn from @param
+    // len data points, see bags.
+    static std::vector<uint64_t> bagOf( const std::vector<size_t> &idx, size_t len )
+    {
+      std::vector<uint64_t> bag( ( len + 63 ) / 64, 0 );
+      for ( auto& i : idx ) bag[i >> 6] |= static_cast<uint64_t>( 1 ) << ( i & 63 );
+      return bag;
+    }
+
+    // Grow a whole tree into the empty @param sapling from the data
+    // points @param idx.
+    template <SplittingOrder order, typename feature_t>
+    void nurture( Sapling &sapling,
+                  const std::vector<feature_t>& dataPoints,
+                  std::vector<size_t> &idx,
+                  typename kernel<dataType>::Options &options,
+                  RandomStream &rng )
+    {
+      sapling.sprout( 0 );
+      expand<order>( sapling, dataPoints, 0,
+                     typename kernel<dataType>::State( &idx[0], idx.size(), options ),
+                     options, rng );
+    }
+
+    // Move all the nodes of @param sapling into the forest and return
+    // the node ID of its root. Nodes are appended in the order of
+    // their local IDs. If @param rootID is given, the root of the
+    // sapling replaces that (leaf) node of the forest instead, which
+    // is how a leaf is regrown in place.
+    size_t graft( Sapling &sapling, size_t rootID = NULL_NODE )
+    {
+      size_t n = sapling.child.size();
+      size_t base = child.size();
+      // local node i > 0 (or all of them if no rootID) becomes offset + i
+      size_t offset = ( NULL_NODE == rootID ) ? base : base - 1;
+      size_t total = ( NULL_NODE == rootID ) ? base + n : base + n - 1;
+      child.resize( total );
+      judge.resize( total );
+      level.resize( total );
+      store.resize( total );
+      arenas.push_back( sapling.arena );
+      for ( size_t i=0; i<n; i++ ) {
+        size_t id = ( 0 == i && NULL_NODE != rootID ) ? rootID : offset + i;
+        for ( auto& c : sapling.child[i] ) c += offset;
+        child[id].swap( sapling.child[i] );
+        judge[id] = std::move( sapling.judge[i] );
+        level[id] = sapling.level[i];
+        store[id].swap( sapling.store[i] );
       }
+      return ( NULL_NODE == rootID ) ? base : rootID;
+    }
 
-      worklist.push_back( std::make_pair( root,
-                                          typename kernel<dataType>::State( &idx[0],
-                                                                            idx.size(),
-                                                                            options ) ) );
-      std::vector<int> label( dataPoints.size() );
+    // Grow the subtree of @param tree rooted at the (childless) node
+    // @param rootID, whose data points are described by @param
+    // rootState. The node and all its descendants that cannot be split
+    // further become leaves and keep the data point IDs in their
+    // stores.
+    template <SplittingOrder order, typename feature_t>
+    void expand( Sapling &tree,
+                 const std::vector<feature_t>& dataPoints,
+                 size_t rootID,
+                 typename kernel<dataType>::State&& rootState,
+                 typename kernel<dataType>::Options& options,
+                 RandomStream &rng,
+                 ENABLE_IF(LEVEL!=order) )
+    {
+      Worklist<std::pair<size_t,typename kernel<dataType>::State> > worklist;
+      
+      // label[i] is the branch label of the data point rootState.idx[i]
+      // under the current node, and is permuted along with idx
+      size_t *base = rootState.idx;
+      std::vector<int> label( rootState.len );
+      // buffers of the partitions, reused by every split
+      std::vector<size_t> count;
+      std::vector<size_t> curpos;
+      std::vector<size_t> partition;
 
+      worklist.emplace_back( rootID, std::move( rootState ) );
+      const size_t entryBytes = sizeof(typename decltype(worklist)::value_type);
+      charge( label.size() * sizeof(int) + entryBytes );
 
       while ( !worklist.empty() ) {
-        size_t nodeID = fetch<order>(worklist).first;
-        typename kernel<dataType>::State state = std::move( fetch<order>(worklist).second );
-        pop<order>( worklist );
+        // close to the memory budget, continue depth first, which
+        // keeps the worklist short
+        bool back = ( DFS == order ) || nearBudget();
+        size_t nodeID = fetch( worklist, back ).first;
+        typename kernel<dataType>::State state = std::move( fetch( worklist, back ).second );
+        pop( worklist, back );
+        release( entryBytes );
+        size_t offset = state.idx - base;
+
+        // small enough, grow the rest of this subtree out of a
+        // contiguous copy of its feature rows
+        if ( 0 < options.gatherNum && state.len <= options.gatherNum && !overBudget() ) {
+          seedGathered<order>( tree, dataPoints, nodeID, std::move( state ), options, rng );
+          continue;
+        }
         
-        // try split
-        typename kernel<dataType>::splitter newJudge;
-        ElectionStatus status = kernel<dataType>::ElectSplitter( dataPoints, dim, state, newJudge, options );
+        // try split, electing the splitter in place
+        ElectionStatus status = capNode() ? MEMORY_LIMIT_REACHED :
+          kernel<dataType>::ElectSplitter( dataPoints, dim, state, tree.judge[nodeID], options, rng );
         
         if ( SUCCESS == status ) {
-          // assign newJudge
-          judge[nodeID] = std::move( newJudge );
-
           // calculate branch label
           int maxLabel = -1;
           for ( size_t i=0; i<state.len; i++ ) {
-            label[state.idx[i]] = judge[nodeID]( dataPoints[state.idx[i]] );
-            if ( label[state.idx[i]] > maxLabel ) {
-              maxLabel = label[state.idx[i]];
+            label[offset+i] = tree.judge[nodeID]( dataPoints[state.idx[i]] );
+            if ( label[offset+i] > maxLabel ) {
+              maxLabel = label[offset+i];
             }
           }
-          
-          if ( 0 == maxLabel ) continue;
 
-          // in place counting sort (partition)
-          std::vector<size_t> count( maxLabel + 1, 0 );
-          for ( size_t i=0; i<state.len; i++ ) count[label[state.idx[i]]]++;
-          bool split = true;
+          // in place counting sort (partition), only when every
+          // branch receives at least one data point
+          count.assign( maxLabel + 1, 0 );
+          for ( size_t i=0; i<state.len; i++ ) count[label[offset+i]]++;
+          bool split = 0 < maxLabel;
           for ( int k=0; k<=maxLabel; k++ ) {
             if ( 0 == count[k] ) { 
               split = false;
               break;
             }
           }
-          if ( ! split ) continue;
-          std::vector<size_t> curpos( maxLabel + 1, 0 );
-          for ( int k=1; k<=maxLabel; k++ ) curpos[k] = curpos[k-1] + count[k-1];
-          std::vector<size_t> partition( maxLabel + 2, 0 );
-          for ( int k=1; k<=maxLabel; k++ ) partition[k] = curpos[k];
-          partition[maxLabel+1] = state.len;
 
-          for ( int k=0; k<=maxLabel; k++ ) {
-            size_t i = curpos[k];
-            while ( i < partition[k+1] ) {
-              int k1 = label[state.idx[i]];
-              if ( k1 != k ) {
-                size_t j = curpos[k1]++;
-                size_t tmp = state.idx[i];
-                state.idx[i] = state.idx[j];
-                state.idx[j] = tmp;
-              } else {
-                i++;
+          if ( split ) {
+            curpos.assign( maxLabel + 1, 0 );
+            for ( int k=1; k<=maxLabel; k++ ) curpos[k] = curpos[k-1] + count[k-1];
+            partition.assign( maxLabel + 2, 0 );
+            for ( int k=1; k<=maxLabel; k++ ) partition[k] = curpos[k];
+            partition[maxLabel+1] = state.len;
+
+            for ( int k=0; k<=maxLabel; k++ ) {
+              size_t i = curpos[k];
+              while ( i < partition[k+1] ) {
+                int k1 = label[offset+i];
+                if ( k1 != k ) {
+                  size_t j = curpos[k1]++;
+                  std::swap( state.idx[i], state.idx[j] );
+                  std::swap( label[offset+i], label[offset+j] );
+                } else {
+                  i++;
+                }
               }
             }
+
+            // split
+            tree.child[nodeID].reserve( maxLabel + 1 );
+            for ( int k=0; k<=maxLabel; k++ ) {
+              size_t id = tree.sprout( state.depth + 1 );
+              tree.child[nodeID].push_back( id );
+              worklist.emplace_back( id, typename kernel<dataType>::State( state.idx + partition[k],
+                                                                           partition[k+1] - partition[k],
+                                                                           state ) );
+            }
+            charge( ( maxLabel + 1 ) * ( nodeBytes() + entryBytes ) );
+            continue;
+          }
+        }
+
+        // leaf
+        tree.store[nodeID].assign( state.idx, state.idx + state.len );
+        charge( state.len * sizeof(size_t) );
+      }
+      release( label.size() * sizeof(int) );
+    }
+
+
+    // The number of statistics (doubles) the LEVEL order expand()
+    // measures at once, and the number of data points below which it
+    // does not spread the work of a chunk over threads.
+    static const size_t LEVEL_STATS = static_cast<size_t>( 1 ) << 22;
+    static const size_t LEVEL_PARALLEL = 4096;
+
+    // The LEVEL order version of expand(). The subtree is grown one
+    // depth at a time: all the nodes of the current depth (the
+    // frontier) propose their hypotheses, a single pass over their
+    // data points in the order of rootState.idx measures the
+    // statistics of every point under the hypotheses of its node, and
+    // every node then elects its splitter and partitions its data
+    // points stably into the children, which form the next frontier.
+    //
+    // Since the partition is stable, the data points of every node
+    // keep the order they had in rootState.idx (sorted for a whole
+    // tree, see bootstrap()), so that each pass reads the feature rows
+    // front to back.
+    //
+    // The statistics take numStats() doubles per data point. The
+    // frontier is measured, elected and partitioned in chunks of
+    // consecutive nodes holding at most LEVEL_STATS doubles together,
+    // so the buffer never exceeds the larger of LEVEL_STATS and the
+    // statistics of the largest single node (the root, with all of its
+    // data points). Within a chunk, the data points are measured and
+    // the nodes partitioned in parallel, if nested parallelism leaves
+    // threads to do so. The elections stay serial, as the kernel
+    // shares its buffers across the nodes of a tree.
+    template <SplittingOrder order, typename feature_t>
+    void expand( Sapling &tree,
+                 const std::vector<feature_t>& dataPoints,
+                 size_t rootID,
+                 typename kernel<dataType>::State&& rootState,
+                 typename kernel<dataType>::Options& options,
+                 RandomStream &rng,
+                 ENABLE_IF(LEVEL==order) )
+    {
+      typedef typename kernel<dataType>::State State;
+      typedef typename kernel<dataType>::Proposal Proposal;
+
+      struct Front
+      {
+        size_t nodeID;
+        State state;
+        Proposal proposal;
+        ElectionStatus status;
+        // where the statistics of its data points begin in stats[]
+        size_t statBegin;
+        size_t numStats;
+        // the boundaries of its children in state.idx if it is split,
+        // and empty if it is a leaf
+        std::vector<size_t> partition;
+        Front( size_t nodeID, State&& state )
+          : nodeID( nodeID ), state( std::move( state ) ), proposal(), status( SUCCESS ),
+            statBegin( 0 ), numStats( 0 ), partition() {}
+        Front( Front&& other ) = default;
+      };
+
+      size_t *base = rootState.idx;
+      std::vector<int> label( rootState.len );
+      std::vector<size_t> buffer( rootState.len );
+      std::vector<double> stats;
+      std::vector<Front> frontier;
+      std::vector<Front> next;
+      frontier.emplace_back( rootID, std::move( rootState ) );
+
+      charge( label.size() * ( sizeof(int) + sizeof(size_t) ) );
+
+      while ( !frontier.empty() ) {
+        // propose, in the order of the frontier
+        for ( auto& front : frontier ) {
+          front.status = capNode() ? MEMORY_LIMIT_REACHED :
+            kernel<dataType>::Propose( front.state, options, rng, front.proposal );
+          front.numStats = SUCCESS == front.status ?
+            front.state.len * kernel<dataType>::numStats( front.proposal ) : 0;
+        }
+
+        next.clear();
+        for ( size_t first=0; first<frontier.size(); ) {
+          // the chunk [first, last)
+          size_t last = first;
+          size_t total = 0;
+          size_t points = 0;
+          while ( last < frontier.size() &&
+                  ( last == first || total + frontier[last].numStats <= LEVEL_STATS ) ) {
+            frontier[last].statBegin = total;
+            total += frontier[last].numStats;
+            points += frontier[last].state.len;
+            last++;
+          }
+          bool parallel = points >= LEVEL_PARALLEL;
+
+          // measure, in one pass over the data points
+          charge( total * sizeof(double) );
+          stats.resize( total );
+#         pragma omp parallel if ( parallel )
+          for ( size_t f=first; f<last; f++ ) {
+            Front &front = frontier[f];
+            if ( SUCCESS != front.status ) continue;
+            size_t width = kernel<dataType>::numStats( front.proposal );
+            double *out = stats.data() + front.statBegin;
+#           pragma omp for schedule(static) nowait
+            for ( size_t i=0; i<front.state.len; i++ ) {
+              kernel<dataType>::Measure( dataPoints, dim, front.proposal, dataPoints[front.state.idx[i]],
+                                         out + i * width );
+            }
+          }
+
+          // elect
+          for ( size_t f=first; f<last; f++ ) {
+            Front &front = frontier[f];
+            if ( SUCCESS != front.status ) continue;
+            front.status = kernel<dataType>::Elect( dataPoints, dim, front.state, front.proposal,
+                                                    stats.data() + front.statBegin,
+                                                    tree.judge[front.nodeID], options,
+                                                    &label[front.state.idx - base] );
           }
 
-          // split
-#         pragma omp critical
+          // partition, every node within its own range of the buffers
+#         pragma omp parallel if ( parallel )
           {
-            for ( int k=0; k<=maxLabel; k++ ) {
-              size_t id = child.size();
-              child.emplace_back();
-              judge.emplace_back();
-              store.emplace_back();
-              level.emplace_back( state.depth + 1 );
-              child[nodeID].push_back( id );
-              worklist.push_back( std::make_pair( id,
-                                                  typename kernel<dataType>::State( state.idx + partition[k],
-                                                                                    partition[k+1] - partition[k],
-                                                                                    state ) ) );
+            std::vector<size_t> count;
+#           pragma omp for schedule(dynamic)
+            for ( size_t f=first; f<last; f++ ) {
+              Front &front = frontier[f];
+              front.partition.clear();
+              if ( SUCCESS != front.status ) continue;
+              State &state = front.state;
+              size_t offset = state.idx - base;
+              int maxLabel = -1;
+              for ( size_t i=0; i<state.len; i++ ) {
+                maxLabel = std::max( maxLabel, label[offset+i] );
+              }
+              count.assign( maxLabel + 1, 0 );
+              for ( size_t i=0; i<state.len; i++ ) count[label[offset+i]]++;
+              bool split = 0 < maxLabel;
+              for ( int k=0; k<=maxLabel; k++ ) {
+                if ( 0 == count[k] ) {
+                  split = false;
+                  break;
+                }
+              }
+              if ( !split ) continue;
+
+              std::vector<size_t> &partition = front.partition;
+              partition.assign( maxLabel + 2, 0 );
+              for ( int k=0; k<=maxLabel; k++ ) partition[k+1] = partition[k] + count[k];
+              // stable counting sort through the buffer, with count
+              // reused as the write positions
+              std::copy( partition.begin(), partition.end() - 1, count.begin() );
+              for ( size_t i=0; i<state.len; i++ ) {
+                buffer[offset + count[label[offset+i]]++] = state.idx[i];
+              }
+              std::copy( buffer.begin() + offset, buffer.begin() + offset + state.len, state.idx );
             }
           }
-        } else {
-          for ( size_t i=0; i<state.len; i++ ) {
-            store[nodeID].push_back( state.idx[i] );
+
+          // create the children and the leaves, in the order of the
+          // frontier
+          for ( size_t f=first; f<last; f++ ) {
+            Front &front = frontier[f];
+            State &state = front.state;
+            const std::vector<size_t> &partition = front.partition;
+            if ( partition.empty() ) {
+              tree.store[front.nodeID].assign( state.idx, state.idx + state.len );
+              charge( state.len * sizeof(size_t) );
+              continue;
+            }
+            size_t numChildren = partition.size() - 1;
+            tree.child[front.nodeID].reserve( numChildren );
+            for ( size_t k=0; k<numChildren; k++ ) {
+              size_t id = tree.sprout( state.depth + 1 );
+              tree.child[front.nodeID].push_back( id );
+              next.emplace_back( id, State( state.idx + partition[k],
+                                            partition[k+1] - partition[k],
+                                            state ) );
+            }
+            charge( numChildren * nodeBytes() );
           }
+          release( total * sizeof(double) );
+          first = last;
         }
+        frontier.swap( next );
       }
-      return root;
+      release( label.size() * ( sizeof(int) + sizeof(size_t) ) );
+    }
+    
+    // Grow the subtree of @param tree rooted at @param rootID, whose
+    // data points are
+    // described by @param state. As state.idx is an arbitrary
+    // permutation of row IDs at this point, the feature rows are first
+    // gathered into a contiguous buffer, and the children are then
+    // partitioned by physically moving rows inside the buffer, so that
+    // every node in the subtree scans a consecutive block of memory.
+    // ids[i] keeps the original row ID of the i-th buffered row, and
+    // is what ends up in the leaf stores.
+    template <SplittingOrder order, typename feature_t>
+    void seedGathered( Sapling &tree,
+                       const std::vector<feature_t>& dataPoints,
+                       size_t rootID,
+                       typename kernel<dataType>::State&& rootState,
+                       typename kernel<dataType>::Options& options,
+                       RandomStream &rng )
+    {
+      size_t len = rootState.len;
+      size_t scratch = len * ( dim * sizeof(dataType) + sizeof(dataType*) + 2 * sizeof(size_t) + sizeof(int) );
+      charge( scratch );
+      std::vector<size_t> ids( rootState.idx, rootState.idx + len );
+      std::vector<dataType> buffer( len * dim );
+      std::vector<dataType*> rows( len );
+      for ( size_t i=0; i<len; i++ ) {
+        rows[i] = &buffer[i * dim];
+        for ( int j=0; j<dim; j++ ) {
+          rows[i][j] = dataPoints[ids[i]][j];
+        }
+      }
+
+      // rows are moved instead of indices, so the local index array
+      // stays the identity and state.idx - &local[0] is the offset of
+      // a node's block in the buffer
+      std::vector<size_t> local( len );
+      std::iota( local.begin(), local.end(), 0 );
+      std::vector<int> label( len );
+      std::vector<size_t> count;
+      std::vector<size_t> curpos;
+      std::vector<size_t> partition;
+      
+      Worklist<std::pair<size_t,typename kernel<dataType>::State> > worklist;
+      worklist.emplace_back( rootID, std::move( rootState ) );
+      worklist.back().second.idx = &local[0];
+
+      while ( !worklist.empty() ) {
+        size_t nodeID = fetch<order>(worklist).first;
+        typename kernel<dataType>::State state = std::move( fetch<order>(worklist).second );
+        pop<order>( worklist );
+        size_t offset = state.idx - &local[0];
+        
+        ElectionStatus status = capNode() ? MEMORY_LIMIT_REACHED :
+          kernel<dataType>::ElectSplitter( rows, dim, state, tree.judge[nodeID], options, rng );
+
+        if ( SUCCESS == status ) {
+          int maxLabel = -1;
+          for ( size_t i=offset; i<offset+state.len; i++ ) {
+            label[i] = tree.judge[nodeID]( rows[i] );
+            if ( label[i] > maxLabel ) {
+              maxLabel = label[i];
+            }
+          }
+          
+          count.assign( maxLabel + 1, 0 );
+          for ( size_t i=offset; i<offset+state.len; i++ ) count[label[i]]++;
+          bool split = 0 < maxLabel;
+          for ( int k=0; k<=maxLabel; k++ ) {
+            if ( 0 == count[k] ) { 
+              split = false;
+              break;
+            }
+          }
+
+          if ( split ) {
+            curpos.assign( maxLabel + 1, 0 );
+            for ( int k=1; k<=maxLabel; k++ ) curpos[k] = curpos[k-1] + count[k-1];
+            partition.assign( maxLabel + 2, 0 );
+            for ( int k=1; k<=maxLabel; k++ ) partition[k] = curpos[k];
+            partition[maxLabel+1] = state.len;
+
+            // in place counting sort on the rows themselves
+            for ( int k=0; k<=maxLabel; k++ ) {
+              size_t i = curpos[k];
+              while ( i < partition[k+1] ) {
+                int k1 = label[offset+i];
+                if ( k1 != k ) {
+                  size_t j = curpos[k1]++;
+                  std::swap_ranges( rows[offset+i], rows[offset+i] + dim, rows[offset+j] );
+                  std::swap( ids[offset+i], ids[offset+j] );
+                  std::swap( label[offset+i], label[offset+j] );
+                } else {
+                  i++;
+                }
+              }
+            }
+
+            tree.child[nodeID].reserve( maxLabel + 1 );
+            for ( int k=0; k<=maxLabel; k++ ) {
+              size_t id = tree.sprout( state.depth + 1 );
+              tree.child[nodeID].push_back( id );
+              worklist.emplace_back( id, typename kernel<dataType>::State( state.idx + partition[k],
+                                                                           partition[k+1] - partition[k],
+                                                                           state ) );
+            }
+            charge( ( maxLabel + 1 ) * nodeBytes() );
+            continue;
+          }
+        }
+
+        // leaf
+        tree.store[nodeID].assign( ids.begin() + offset, ids.begin() + offset + state.len );
+        charge( state.len * sizeof(size_t) );
+      }
+      release( scratch );
     }
 
 
+    // +-------------------------------------------------------------------------------
+    // Sharded Training Operations
+    //
+    // A forest of n trees can be grown by numShards processes, each
+    // growing a shard of consecutive trees with growShard(). As every
+    // tree draws from the random stream of its tree ID, the trees are
+    // the same as those grow() would have grown with the same seed
+    // (see setRandomSeed()). The shards are then assembled either by
+    // gather() over a Transport (see aux/Transport.hpp), or by having
+    // every process write() its shard and read()ing all the
+    // directories in shard order.
+  public:
+
+    // Grow shard @param shard (out of @param numShards) of a forest of
+    // @param n trees, i.e. trees n * shard / numShards, ..., n * (shard
+    // + 1) / numShards - 1 of it, which become trees 0, 1, ... of this
+    // forest.
+    template <SplittingOrder order = DFS,
+              typename feature_t>
+    void growShard( int n,
+                    const std::vector<feature_t>& dataPoints,
+                    int dataDim,
+                    typename kernel<dataType>::Options options,
+                    int shard,
+                    int numShards,
+                    bool silent = false )
+    {
+      int first = static_cast<int>( static_cast<int64_t>( n ) * shard / numShards );
+      int last = static_cast<int>( static_cast<int64_t>( n ) * ( shard + 1 ) / numShards );
+      grow<order>( 0, dataPoints, dataDim, options, silent );
+      numStreams = first;
+      plant<order>( last - first, dataPoints, options, silent );
+      numStreams = n;
+    }
+
+    // Collect the trees of all the ranks of @param transport on rank
+    // 0, after each rank has grown its shard with growShard( ...,
+    // transport.rank(), transport.size() ). Rank 0 ends up with the
+    // whole forest, with the trees in shard order, and the other
+    // ranks keep their own shards. The nodes of the received trees are
+    // numbered in preorder, as read() numbers them, and their bags
+    // come along with them. Returns false if a message was lost or
+    // broken, in which case the forest of rank 0 is left as it was.
+    bool gather( Transport &transport )
+    {
+      if ( 0 != transport.rank() ) {
+        OutArchive out;
+        out.put( static_cast<uint64_t>( numTrees() ) );
+        out.put( numStreams );
+        std::vector<std::vector<char> > encoded( numTrees() );
+#       pragma omp parallel for
+        for ( int t=0; t<numTrees(); t++ ) {
+          OutArchive tree;
+          encodeTree( tree, t, Format() );
+          encoded[t].assign( tree.data(), tree.data() + tree.size() );
+        }
+        for ( auto& ele : encoded ) out.putVector( ele );
+        for ( auto& bag : bags ) out.putVector( bag );
+        std::vector<char> message;
+        out.seal( message );
+        return transport.send( 0, message );
+      }
+
+      // every shard is received and decoded before the first tree is
+      // grafted, so that a failure leaves the forest as it was
+      std::vector<std::vector<Sapling> > received( transport.size() );
+      std::vector<std::vector<std::vector<uint64_t> > > receivedBags( transport.size() );
+      int newDim = 0 < numTrees() ? dim : -1;
+      uint64_t newStreams = numStreams;
+      for ( int r=1; r<transport.size(); r++ ) {
+        std::vector<char> message;
+        InArchive in;
+        if ( !transport.recv( r, message ) ) return false;
+        in.assign( std::move( message ) );
+        if ( !in.verify() ) return false;
+        uint64_t n = 0;
+        uint64_t streams = 0;
+        in.get( n );
+        in.get( streams );
+        if ( !in.good() || n > in.remain() ) return false;
+        std::vector<Sapling> &saplings = received[r];
+        saplings.resize( n );
+        std::vector<InArchive> trees( n );
+        for ( auto& tree : trees ) {
+          std::vector<char> bytes;
+          in.getVector( bytes );
+          tree.assign( std::move( bytes ) );
+        }
+        receivedBags[r].resize( n );
+        for ( auto& bag : receivedBags[r] ) in.getVector( bag );
+        if ( !in.good() || !in.exhausted() ) return false;
+        std::vector<int> dims( n );
+        std::vector<int> decoded( n );
+#       pragma omp parallel for
+        for ( int64_t t=0; t<static_cast<int64_t>( n ); t++ ) {
+          decoded[t] = decodeTree( trees[t], saplings[t], dims[t] ) ? 1 : 0;
+        }
+        for ( uint64_t t=0; t<n; t++ ) {
+          if ( !decoded[t] ) return false;
+          if ( -1 == newDim ) newDim = dims[t];
+          if ( dims[t] != newDim ) return false;
+        }
+        newStreams = std::max( newStreams, streams );
+      }
+
+      dropAggregates();
+      if ( -1 != newDim ) dim = newDim;
+      for ( int r=1; r<transport.size(); r++ ) {
+        for ( size_t t=0; t<received[r].size(); t++ ) {
+          roots.push_back( graft( received[r][t] ) );
+          bags.push_back( std::move( receivedBags[r][t] ) );
+          Sapling().swap( received[r][t] );
+        }
+      }
+      numStreams = newStreams;
+      return true;
+    }
+
     // +-------------------------------------------------------------------------------
     // Input and Output Operations
 
   public:
-    void write( std::string dir ) const
+
+    // How write() encodes the trees. The default is the plain format,
+    // which is lossless. The compact format stores counts and leaf
+    // stores as varints (leaf stores sorted and delta coded), and
+    // feature values and the thresholds of splitters in the given
+    // precision (thresholds as floats unless FULL_PRECISION). It can
+    // additionally compress each tree with the LZ block codec in
+    // aux/Codec.hpp.
+    //
+    // HALF_PRECISION and BYTE_PRECISION do not only shrink the files:
+    // as the vantage points move by their quantization error, points
+    // close to a threshold, in particular the data points on it, may
+    // reach a different leaf once the forest is read back. The
+    // thresholds are lowered to keep most of the latter on their
+    // branch (see BinaryOnDistance::writeCompact()), and points far
+    // from every threshold keep their leaves. Use FULL_PRECISION where
+    // queries must reach exactly the leaves of the written forest.
+    struct Format
+    {
+      bool compact;
+      Precision precision;
+      bool lz;
+      
+      Format() : compact(false), precision(FULL_PRECISION), lz(false) {}
+      Format( Precision p, bool useLZ = false ) : compact(true), precision(p), lz(useLZ) {}
+    };
+
+    // Every tree is written to its own file dir/tree.<treeID> (see
+    // writeTree() for the layout). Trees are encoded in parallel, each
+    // into its own in-memory archive, which is then written with a
+    // single call.
+    void write( std::string dir, Format format = Format() ) const
     {
       system( strf( "mkdir -p %s", dir.c_str() ).c_str() );
       system( strf( "rm -rf %s/*", dir.c_str() ).c_str() );
+      bool ok = true;
+#     pragma omp parallel for reduction(&& : ok)
       for ( int treeID=0; treeID<numTrees(); treeID++ ) {
-        writeTree( dir, treeID );
+        ok = writeTree( dir, treeID, format ) && writeBag( dir, treeID ) && ok;
+      }
+      if ( !ok ) {
+        Error( "RanForest: failed to write forest to %s.", dir.c_str() );
+        exit( -1 );
       }
     }
 
-    Forest ( std::string dir )
+    Forest ( std::string dir ) : dim(0), roots(), child(), judge(), level(), store(), arenas(), slack(false), bags(), pool(),
+                                 randomSeed(0), numStreams(0),
+                                 aggWidth(0), leafSlot(), aggregates(), budget( std::make_shared<Budget>() )
     {
       read( dir );
     }
     
-    void read( std::string dir )
+    // Read the forest written by write(). The tree files are loaded
+    // and decoded in parallel, and grafted in the order of tree IDs,
+    // so node IDs are the same as with a sequential read. Files in the
+    // older format (terminated by an "END" marker instead of a
+    // checksum) are still accepted.
+    void read( std::string dir, bool silent = false )
+    {
+      read( std::vector<std::string>( 1, dir ), silent );
+    }
+
+    // Read the forests written to each of @param dirs (e.g. by the
+    // workers of a sharded training, see growShard()) as a single
+    // forest, whose trees are those of dirs[0], followed by those of
+    // dirs[1], and so on.
+    void read( const std::vector<std::string> &dirs, bool silent = false )
     {
       roots.clear();
       child.clear();
       judge.clear();
       level.clear();
       store.clear();
+      arenas.clear();
+      slack = false;
+      bags.clear();
+      dropAggregates();
 
-      int n = 0;
-      do {
-        if ( probeFile( strf( "%s/tree.%d", dir.c_str(), n ) ) ) {
-          n++;
-        } else {
-          break;
+      // the (dir, treeID) of every tree in the merged order
+      std::vector<std::pair<size_t,int> > files;
+      for ( size_t d=0; d<dirs.size(); d++ ) {
+        for ( int t=0; probeFile( strf( "%s/tree.%d", dirs[d].c_str(), t ) ); t++ ) {
+          files.push_back( std::make_pair( d, t ) );
         }
-      } while (true);
+      }
+      int n = static_cast<int>( files.size() );
       
       roots.resize(n);
-      dim = -1;
+      bags.resize(n);
+      numStreams = n;
 
+      std::vector<Sapling> saplings(n);
+      std::vector<int> dims(n);
+      // not vector<bool>, whose elements share words across threads
+      std::vector<char> ok( n, 0 );
+      std::vector<char> bagOk( n, 0 );
       ProgressBar progressbar;
       progressbar.reset( n );
+      int complete = 0;
+#     pragma omp parallel for
+      for ( int i=0; i<n; i++ ) {
+        ok[i] = readTree( dirs[files[i].first], files[i].second, saplings[i], dims[i] );
+        bagOk[i] = readBag( dirs[files[i].first], files[i].second, bags[i] );
+#       pragma omp critical
+        {
+          if ( !silent ) {
+            progressbar.update( ++complete, "Reading Forest" );
+          }
+        }
+      }
+
+      dim = 0 < n ? dims[0] : 0;
       for ( int i=0; i<n; i++ ) {
-        readTree( dir, i );
-        progressbar.update( i+1, "Reading Forest" );
+        if ( !ok[i] ) {
+          Error( "RanForest: %s/tree.%d is corrupted or truncated.",
+                 dirs[files[i].first].c_str(), files[i].second );
+          exit( -1 );
+        }
+        if ( !bagOk[i] ) {
+          Error( "RanForest: %s/bag.%d is corrupted or truncated.",
+                 dirs[files[i].first].c_str(), files[i].second );
+          exit( -1 );
+        }
+        if ( dims[i] != dim ) {
+          Error( "RanForest: dimension doesn't agree across trees." );
+          exit( -1 );
+        }
+        roots[i] = graft( saplings[i] );
+        Sapling().swap( saplings[i] );
       }
     }
 
   private:
-    
-    // Put a sign at the end of a binary file
-    static void seal( FILE* out )
+
+    // the first 4 bytes of a tree file, in the plain and in the
+    // compact format
+    static const char* magic()
     {
-      char ch[4] = "END";
-      fwrite( ch, sizeof(char), 4, out );
+      return "RFT2";
     }
-    
-    // Check whether a correct sign is present 
-    static bool unseal( FILE* in )
+
+    static const char* compactMagic()
     {
-      char ch[4];
-      fread( ch, sizeof(char), 4, in );
-      return 0 == strcmp( ch, "END" );
+      return "RFT3";
     }
 
-    
-    void writeTree( std::string dir, int treeID ) const
+    // Layout of a tree file in the plain format:
+    // - the magic bytes "RFT2"
+    // - dim (int)
+    // - the nodes in preorder. Each node starts with its number of
+    //   children (int), followed by the leaf store if it is 0, or by
+    //   the splitter otherwise.
+    // - a 64 bit checksum of all the above
+    //
+    // Layout of a tree file in the compact format:
+    // - the magic bytes "RFT3"
+    // - dim (int), precision (uint8_t), whether LZ is applied (uint8_t)
+    // - the nodes in preorder, as in the plain format but with
+    //   varints for the number of children, delta coded leaf stores,
+    //   and splitters written by writeCompact(). With LZ, they are
+    //   preceded by their length (varint) and compressed as one block.
+    // - a 64 bit checksum of all the above
+    //
+    // Nodes are visited with an explicit stack, so arbitrarily deep
+    // trees do not overflow the call stack.
+    //
+    // The bag of tree treeID (see bags) goes to a file dir/bag.<treeID>
+    // of its own, as a vector of 64 bit words followed by a checksum.
+    // It is not written if the bag is unknown, and a missing bag file
+    // reads as an unknown bag, as with files written before bags were
+    // kept.
+    bool writeTree( std::string dir, int treeID, const Format &format ) const
     {
-      WITH_OPEN( out, strf( "%s/tree.%d", dir.c_str(), treeID ).c_str(), "wb" );
-      fwrite( &dim, sizeof(int), 1, out );
-      writeNode( out, roots[treeID] );
-      seal( out );
-      END_WITH( out );
+      OutArchive out;
+      encodeTree( out, treeID, format );
+      return out.save( strf( "%s/tree.%d", dir.c_str(), treeID ) );
     }
 
-    void writeNode( FILE* out, size_t nodeID ) const
+    bool writeBag( std::string dir, int treeID ) const
     {
-      int len = static_cast<int>( child[nodeID].size() );
-      fwrite( &len, sizeof(int), 1, out );
-      if ( 0 == len ) {
-        writeVector( out, store[nodeID] );
+      if ( bags[treeID].empty() ) return true;
+      OutArchive out;
+      out.putVector( bags[treeID] );
+      return out.save( strf( "%s/bag.%d", dir.c_str(), treeID ) );
+    }
+
+    // Read the bag of tree @param treeID into @param bag, left empty if
+    // there is no bag file. Returns false if the file is broken.
+    static bool readBag( std::string dir, int treeID, std::vector<uint64_t> &bag )
+    {
+      bag.clear();
+      std::string filename = strf( "%s/bag.%d", dir.c_str(), treeID );
+      if ( !probeFile( filename ) ) return true;
+      InArchive in;
+      if ( !in.load( filename ) || !in.verify() ) return false;
+      in.getVector( bag );
+      return in.good() && in.exhausted();
+    }
+
+    // Encode tree @param treeID as the contents of its file, without
+    // the checksum.
+    void encodeTree( OutArchive &out, int treeID, const Format &format ) const
+    {
+      if ( !format.compact ) {
+        out.write( magic(), 4 );
+        out.put( dim );
+        writeNodes( out, roots[treeID], format );
       } else {
-        judge[nodeID].write( out );
+        out.write( compactMagic(), 4 );
+        out.put( dim );
+        out.put( static_cast<uint8_t>( format.precision ) );
+        out.put( static_cast<uint8_t>( format.lz ? 1 : 0 ) );
+        if ( format.lz ) {
+          OutArchive nodes;
+          writeNodes( nodes, roots[treeID], format );
+          std::vector<char> packed;
+          lzCompress( nodes.data(), nodes.size(), packed );
+          out.putVarint( nodes.size() );
+          out.write( packed.data(), packed.size() );
+        } else {
+          writeNodes( out, roots[treeID], format );
+        }
       }
-      for ( int i=0; i<len; i++ ) {
-        writeNode( out, child[nodeID][i] );
+    }
+
+    void writeNodes( OutArchive &out, size_t root, const Format &format ) const
+    {
+      std::vector<size_t> sorted;
+      std::vector<size_t> stack( 1, root );
+      while ( !stack.empty() ) {
+        size_t nodeID = stack.back();
+        stack.pop_back();
+        int len = static_cast<int>( child[nodeID].size() );
+        if ( !format.compact ) {
+          out.put( len );
+          if ( 0 == len ) {
+            out.putVector( store[nodeID] );
+          } else {
+            judge[nodeID].write( out );
+          }
+        } else {
+          out.putVarint( len );
+          if ( 0 == len ) {
+            sorted.assign( store[nodeID].begin(), store[nodeID].end() );
+            std::sort( sorted.begin(), sorted.end() );
+            out.putVarint( sorted.size() );
+            size_t prev = 0;
+            for ( auto& id : sorted ) {
+              out.putVarint( id - prev );
+              prev = id;
+            }
+          } else {
+            judge[nodeID].writeCompact( out, format.precision );
+          }
+        }
+        for ( int i=len-1; i>=0; i-- ) {
+          stack.push_back( child[nodeID][i] );
+        }
       }
     }
 
-    void readTree( std::string dir, int treeID )
+    // Decode tree @param treeID into @param sapling, and its dimension
+    // into @param treeDim. Returns false if the file is broken.
+    static bool readTree( std::string dir, int treeID, Sapling &sapling, int &treeDim )
     {
-      WITH_OPEN( in, strf( "%s/tree.%d", dir.c_str(), treeID ).c_str(), "rb" );
-      int tmp = 0;
-      fread( &tmp, sizeof(int), 1, in );
-      if ( -1 == dim ) {
-        dim = tmp;
-      } else if ( dim != tmp ) {
-        Error( "RanForest: dimension doesn't agree across trees." );
-        exit( -1 );
+      std::string filename = strf( "%s/tree.%d", dir.c_str(), treeID );
+      InArchive in;
+      if ( !in.load( filename ) ) return false;
+      if ( in.remain() < 4 || ( 0 != memcmp( in.cursor(), magic(), 4 ) &&
+                                0 != memcmp( in.cursor(), compactMagic(), 4 ) ) ) {
+        return readLegacyTree( filename, sapling, treeDim );
       }
-      roots[treeID] = child.size();
-      child.emplace_back();
-      judge.emplace_back();
-      level.emplace_back( 0 );
-      store.emplace_back();
-      readNode( in, roots[treeID] );
-      if ( !unseal( in ) ) {
-        Error( "RanForest: unseal() failed, might be due to wrong forest data." );
-        exit( -1 );
+      return in.verify() && decodeTree( in, sapling, treeDim );
+    }
+
+    // Decode the contents written by encodeTree() from @param in into
+    // @param sapling, and the dimension into @param treeDim. Returns
+    // false if they are broken.
+    static bool decodeTree( InArchive &in, Sapling &sapling, int &treeDim )
+    {
+      char head[4] = { 0, 0, 0, 0 };
+      in.read( head, 4 );
+      if ( 0 == memcmp( head, magic(), 4 ) ) {
+        in.get( treeDim );
+        readNodes( in, sapling );
+      } else if ( 0 == memcmp( head, compactMagic(), 4 ) ) {
+        in.get( treeDim );
+        uint8_t precision = 0;
+        uint8_t lz = 0;
+        in.get( precision );
+        in.get( lz );
+        if ( 1 == lz ) {
+          uint64_t rawLen = 0;
+          in.getVarint( rawLen );
+          std::vector<char> raw;
+          // lzDecompress() bounds rawLen by the size of the block
+          if ( !in.good() || !lzDecompress( in.cursor(), in.remain(), raw, rawLen ) ) {
+            return false;
+          }
+          in.assign( std::move( raw ) );
+        }
+        CompactReader reader = { in, static_cast<Precision>( precision ) };
+        readNodes( reader, sapling );
+      } else {
+        return false;
       }
+      return in.good() && in.exhausted();
+    }
+
+    // Reader for the older format, where the nodes are directly
+    // preceded by dim and followed by the "END" marker.
+    static bool readLegacyTree( std::string filename, Sapling &sapling, int &treeDim )
+    {
+      bool ok = false;
+      WITH_OPEN( in, filename.c_str(), "rb" );
+      ok = 1 == fread( &treeDim, sizeof(int), 1, in );
+      readNodes( in, sapling );
+      char ch[4] = { 0, 0, 0, 0 };
+      ok = ok && 4 == fread( ch, sizeof(char), 4, in );
+      ok = ok && 0 == strcmp( ch, "END" );
       END_WITH( in );
+      return ok;
     }
-    
-    void readNode( FILE* in, size_t nodeID ) 
+
+    // Decode the nodes of one tree, written in preorder, with an
+    // explicit stack of (node, number of children still to read).
+    template <typename source_t>
+    static void readNodes( source_t &in, Sapling &sapling )
+    {
+      std::vector<std::pair<size_t,int> > stack;
+      size_t root = sapling.sprout( 0 );
+      int len = readNode( in, sapling, root );
+      if ( 0 < len ) stack.push_back( std::make_pair( root, len ) );
+      while ( !stack.empty() ) {
+        size_t parent = stack.back().first;
+        if ( 0 == stack.back().second-- ) {
+          stack.pop_back();
+          continue;
+        }
+        size_t nodeID = sapling.sprout( sapling.level[parent] + 1 );
+        sapling.child[parent].push_back( nodeID );
+        len = readNode( in, sapling, nodeID );
+        if ( 0 < len ) stack.push_back( std::make_pair( nodeID, len ) );
+      }
+    }
+
+    // Decode the contents of a single node, return its number of children.
+    static int readNode( InArchive &in, Sapling &sapling, size_t nodeID )
     {
       int len = 0;
-      fread( &len, sizeof(int), 1, in );
+      in.get( len );
       if ( 0 == len ) {
-        readVector( in, store[nodeID] );
+        in.getVector( sapling.store[nodeID] );
       } else {
-        judge[nodeID].read( in );
+        sapling.judge[nodeID].read( in );
       }
-      for ( int i=0; i<len; i++ ) {
-        size_t newNode = child.size();
-        child[nodeID].push_back( newNode );
-        child.emplace_back();
-        judge.emplace_back();
-        store.emplace_back();
-        level.emplace_back( level[nodeID] + 1 );
-        readNode( in, newNode );
+      return in.good() ? len : 0;
+    }
+
+    // an archive in the compact format
+    struct CompactReader
+    {
+      InArchive &in;
+      Precision precision;
+    };
+    
+    static int readNode( CompactReader &reader, Sapling &sapling, size_t nodeID )
+    {
+      uint64_t len = 0;
+      reader.in.getVarint( len );
+      if ( 0 == len ) {
+        uint64_t num = 0;
+        reader.in.getVarint( num );
+        // every ID takes at least one byte
+        if ( num > reader.in.remain() ) {
+          reader.in.fail();
+          return 0;
+        }
+        IDList &ids = sapling.store[nodeID];
+        ids.resize( num );
+        uint64_t prev = 0;
+        for ( auto& id : ids ) {
+          uint64_t delta = 0;
+          reader.in.getVarint( delta );
+          prev += delta;
+          id = prev;
+        }
+      } else {
+        sapling.judge[nodeID].readCompact( reader.in, reader.precision );
+      }
+      return reader.in.good() ? static_cast<int>( len ) : 0;
+    }
+
+    static int readNode( FILE *in, Sapling &sapling, size_t nodeID )
+    {
+      int len = 0;
+      if ( 1 != fread( &len, sizeof(int), 1, in ) ) return 0;
+      if ( 0 == len ) {
+        std::vector<size_t> ids;
+        readVector( in, ids );
+        sapling.store[nodeID].assign( ids.begin(), ids.end() );
+      } else {
+        sapling.judge[nodeID].read( in );
       }
+      return len;
     }
 
     // +-------------------------------------------------------------------------------
@@ -452,17 +1615,371 @@ namespace ran_forest
     }
 
 
+    // +-------------------------------------------------------------------------------
+    // Memory Budget
+  public:
+
+    // Bound the memory of the forest while it grows to about @param
+    // bytes (0, the default, for no bound). The usage is an estimate:
+    // the nodes and leaf stores of the forest, plus the worklists,
+    // bootstrap samples and gathered rows of the trees being grown.
+    // Close to the budget (3/4 of it) the trees continue depth first,
+    // which keeps their worklists short, and once it is reached the
+    // nodes still to be split are kept as leaves (with status
+    // MEMORY_LIMIT_REACHED). The data points themselves are not
+    // counted.
+    //
+    // When trees are grown in parallel, which nodes reach the budget
+    // depends on the scheduling of the threads, so a forest grown
+    // under a budget it reaches is not reproducible from its seed.
+    inline void setMemoryBudget( size_t bytes )
+    {
+      budget->limit = bytes;
+    }
+
+    inline size_t memoryBudget() const
+    {
+      return budget->limit;
+    }
+
+    // The estimated memory of the nodes of the forest in bytes.
+    size_t memoryUsage() const
+    {
+      size_t re = child.size() * nodeBytes();
+      for ( auto& s : store ) re += s.size() * sizeof(size_t);
+      return re;
+    }
+
+    // The number of nodes kept as leaves by the budget in the last
+    // call to grow(), plant(), replant() or insert().
+    inline size_t cappedNodes() const
+    {
+      return budget->capped;
+    }
+
+  private:
+
+    // the estimated bytes of a node, apart from its leaf store
+    inline size_t nodeBytes() const
+    {
+      return 2 * sizeof(std::vector<size_t>) + sizeof(typename kernel<dataType>::splitter) + sizeof(int)
+        + dim * sizeof(dataType);
+    }
+
+    inline void resetBudget()
+    {
+      budget->used = memoryUsage();
+      budget->capped = 0;
+    }
+
+    inline void charge( size_t bytes )
+    {
+      budget->used += bytes;
+    }
+
+    inline void release( size_t bytes )
+    {
+      budget->used -= bytes;
+    }
+
+    inline bool overBudget() const
+    {
+      return 0 < budget->limit && budget->used >= budget->limit;
+    }
+
+    inline bool nearBudget() const
+    {
+      return 0 < budget->limit && budget->used >= budget->limit / 4 * 3;
+    }
+
+    // whether a node is to be kept as a leaf by the budget
+    inline bool capNode()
+    {
+      if ( !overBudget() ) return false;
+      budget->capped++;
+      return true;
+    }
+
+
+    // +-------------------------------------------------------------------------------
+    // Leaf Aggregates
+  public:
+
+    // Precompute @param width values for every leaf, which predict()
+    // then averages over the trees instead of going through the leaf
+    // stores. @param fill( store, out ) is called on the leaves in
+    // parallel, and writes the values of the leaf whose data point IDs
+    // are store into out[0], ..., out[width - 1].
+    //
+    // The aggregates are dropped whenever the leaves change (grow(),
+    // plant(), replant(), insert() and read()), and compact() keeps
+    // them.
+    template <typename fill_t>
+    void aggregate( size_t width, fill_t fill )
+    {
+      aggWidth = width;
+      leafSlot.assign( child.size(), NULL_NODE );
+      size_t count = 0;
+      for ( size_t i=0; i<child.size(); i++ ) {
+        if ( child[i].empty() && 0 <= level[i] ) leafSlot[i] = count++;
+      }
+      aggregates.assign( count * width, 0.0f );
+#     pragma omp parallel for schedule(dynamic, 64)
+      for ( size_t i=0; i<child.size(); i++ ) {
+        if ( NULL_NODE == leafSlot[i] ) continue;
+        fill( store[i], &aggregates[leafSlot[i] * width] );
+      }
+    }
+
+    // Aggregate the class posterior of every leaf, where @param labels
+    // holds the class, in [0, numClasses), of each data point ID.
+    void aggregateClasses( const std::vector<int> &labels, int numClasses )
+    {
+      aggregate( numClasses,
+                 [&labels, numClasses]( const IDList &ids, float *out )
+                 {
+                   for ( auto& id : ids ) out[labels[id]] += 1.0f;
+                   if ( ids.empty() ) return;
+                   float scale = 1.0f / ids.size();
+                   for ( int k=0; k<numClasses; k++ ) out[k] *= scale;
+                 } );
+    }
+
+    // Aggregate the mean of @param targets, indexed by data point ID,
+    // over every leaf.
+    void aggregateMean( const std::vector<double> &targets )
+    {
+      aggregate( 1,
+                 [&targets]( const IDList &ids, float *out )
+                 {
+                   double sum = 0.0;
+                   for ( auto& id : ids ) sum += targets[id];
+                   out[0] = ids.empty() ? 0.0f : static_cast<float>( sum / ids.size() );
+                 } );
+    }
+
+    inline size_t aggregateWidth() const
+    {
+      return aggWidth;
+    }
+
+    // The aggregateWidth() values of leaf @param nodeID.
+    inline const float* leafAggregate( size_t nodeID ) const
+    {
+      checkAggregates();
+      return &aggregates[leafSlot[nodeID] * aggWidth];
+    }
+
+    // Write the average of the aggregates of the leaves @param p
+    // reaches into out[0], ..., out[aggregateWidth() - 1].
+    template <typename feature_t>
+    void predict( const feature_t &p, double *out ) const
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      checkAggregates();
+      std::fill( out, out + aggWidth, 0.0 );
+      for ( int t=0; t<numTrees(); t++ ) {
+        const float *value = &aggregates[leafSlot[queryTree( p, t )] * aggWidth];
+        for ( size_t k=0; k<aggWidth; k++ ) out[k] += value[k];
+      }
+      double scale = 1.0 / numTrees();
+      for ( size_t k=0; k<aggWidth; k++ ) out[k] *= scale;
+    }
+
+    template <typename feature_t>
+    std::vector<double> predict( const feature_t &p ) const
+    {
+      std::vector<double> re( aggWidth );
+      predict( p, re.data() );
+      return re;
+    }
+
+    // predict() on each of @param dataPoints in parallel, where the
+    // prediction of point i goes to out[i * aggregateWidth()], ...
+    template <typename feature_t>
+    void predictBatch( const std::vector<feature_t> &dataPoints, double *out ) const
+    {
+      checkAggregates();
+#     pragma omp parallel for
+      for ( size_t i=0; i<dataPoints.size(); i++ ) {
+        predict( dataPoints[i], out + i * aggWidth );
+      }
+    }
+
+    template <typename feature_t>
+    std::vector<double> predictBatch( const std::vector<feature_t> &dataPoints ) const
+    {
+      std::vector<double> re( dataPoints.size() * aggWidth );
+      predictBatch( dataPoints, re.data() );
+      return re;
+    }
+
+  private:
+    
+    inline void checkAggregates() const
+    {
+      if ( leafSlot.size() != child.size() || 0 == numTrees() ) {
+        Error( "RanForest: leaf aggregates are missing or out of date, call aggregate() first." );
+        exit( -1 );
+      }
+    }
+
+    inline void dropAggregates()
+    {
+      aggWidth = 0;
+      leafSlot.clear();
+      aggregates.clear();
+    }
+
+
+    // +-------------------------------------------------------------------------------
+    // Asynchronous Query Operations
+  public:
+
+    // Attach a persistent pool of @param numThreads workers (one per
+    // hardware thread if not positive) to the forest. Subsequent
+    // calls to asyncQuery() and asyncQueryInto() are served by this
+    // pool. Without a pool those calls run inline in the caller.
+    void attachPool( int numThreads = 0 )
+    {
+      pool = std::make_shared<ThreadPool>( numThreads );
+    }
+
+    void detachPool()
+    {
+      pool.reset();
+    }
+
+    // Query all the trees for every point in @param dataPoints, and
+    // write the leaf (or level @param lv) node IDs into the caller
+    // provided buffer @param out, where out[i * numTrees() + t] is the
+    // result of point i in tree t. The work is split into (tree,
+    // tile of @param tile points) jobs. The returned future becomes
+    // ready once the whole buffer is filled. Both @param dataPoints
+    // and @param out must stay alive until then.
+    template <typename feature_t>
+    std::future<void> asyncQueryInto( const std::vector<feature_t> &dataPoints,
+                                      size_t *out,
+                                      int lv = -1,
+                                      size_t tile = 64 ) const
+    {
+      std::shared_ptr<std::promise<void> > done = std::make_shared<std::promise<void> >();
+      std::future<void> re = done->get_future();
+      dispatch( dataPoints, out, lv, tile, [done]() { done->set_value(); } );
+      return re;
+    }
+
+    // Same as asyncQueryInto(), but the results are delivered through
+    // the returned future, in the same layout.
+    template <typename feature_t>
+    std::future<std::vector<size_t> > asyncQuery( const std::vector<feature_t> &dataPoints,
+                                                  int lv = -1,
+                                                  size_t tile = 64 ) const
+    {
+      std::shared_ptr<std::promise<std::vector<size_t> > > done =
+        std::make_shared<std::promise<std::vector<size_t> > >();
+      std::future<std::vector<size_t> > re = done->get_future();
+      std::shared_ptr<std::vector<size_t> > buffer =
+        std::make_shared<std::vector<size_t> >( dataPoints.size() * roots.size() );
+      dispatch( dataPoints, buffer->data(), lv, tile,
+                [done, buffer]() { done->set_value( std::move( *buffer ) ); } );
+      return re;
+    }
+
+  private:
+
+    // Enqueue one job per (tree, query tile) pair, the last job to
+    // complete calls @param finish.
+    template <typename feature_t>
+    void dispatch( const std::vector<feature_t> &dataPoints,
+                   size_t *out,
+                   int lv,
+                   size_t tile,
+                   std::function<void()> finish ) const
+    {
+      static_assert( std::is_same<typename ElementOf<feature_t>::type, dataType>::value,
+                     "element of feature_t should have the same type as dataType." );
+      size_t N = dataPoints.size();
+      size_t T = roots.size();
+      if ( 0 == tile ) tile = 1;
+      size_t tiles = ( N + tile - 1 ) / tile;
+      if ( 0 == tiles * T ) {
+        finish();
+        return;
+      }
+      
+      std::shared_ptr<std::atomic<size_t> > remain =
+        std::make_shared<std::atomic<size_t> >( tiles * T );
+      std::shared_ptr<std::function<void()> > onFinish =
+        std::make_shared<std::function<void()> >( std::move( finish ) );
+      
+      std::vector<std::function<void()> > jobs;
+      jobs.reserve( tiles * T );
+      for ( size_t t=0; t<T; t++ ) {
+        for ( size_t begin=0; begin<N; begin+=tile ) {
+          size_t end = std::min( begin + tile, N );
+          jobs.push_back( [this, &dataPoints, out, lv, t, T, begin, end, remain, onFinish]()
+                          {
+                            for ( size_t i=begin; i<end; i++ ) {
+                              out[i * T + t] = queryTree( dataPoints[i], static_cast<int>( t ), lv );
+                            }
+                            if ( 1 == remain->fetch_sub( 1 ) ) {
+                              (*onFinish)();
+                            }
+                          } );
+        }
+      }
+
+      if ( pool ) {
+        pool->run( jobs );
+      } else {
+        for ( auto& job : jobs ) job();
+      }
+    }
+
+  public:
+
     /* ---------- Accessors ---------- */
     inline const std::vector<size_t> getStore( size_t nodeID ) const
     {
-      return store[nodeID];
+      return std::vector<size_t>( store[nodeID].begin(), store[nodeID].end() );
     }
 
-    // Return the node IDs of the children of the specified node.
     inline const std::vector<size_t> getChildren( size_t nodeID ) const
+    {
+      return std::vector<size_t>( child[nodeID].begin(), child[nodeID].end() );
+    }
+
+    // The same as getStore() and getChildren(), without the copy. The
+    // references are invalidated by any change to the forest.
+    inline const IDList& storeView( size_t nodeID ) const
+    {
+      return store[nodeID];
+    }
+
+    inline const IDList& childrenView( size_t nodeID ) const
     {
       return child[nodeID];
     }
+
+    // Return the splitter of the specified (internal) node.
+    inline const typename kernel<dataType>::splitter& getJudge( size_t nodeID ) const
+    {
+      return judge[nodeID];
+    }
+
+    // Return the depth of the specified node (-1 if retired).
+    inline int getLevel( size_t nodeID ) const
+    {
+      return level[nodeID];
+    }
+
+    // Return the dimension of the feature vectors
+    inline int dimension() const
+    {
+      return dim;
+    }
       
 
     // By default (no parameters provided) it returns the depth of the
@@ -496,7 +2013,9 @@ namespace ran_forest
     inline size_t numLeaves() const
     {
       size_t count = 0; 
-      for ( auto& ele : child ) count += ele.empty() ? 1 : 0;
+      for ( size_t i=0; i<child.size(); i++ ) {
+        count += ( child[i].empty() && 0 <= level[i] ) ? 1 : 0;
+      }
       return count;
     }
 
@@ -505,7 +2024,7 @@ namespace ran_forest
     {
       size_t count = 0;
       for ( size_t i=0; i<child.size(); i++ ) {
-        if ( ( level[i] == lv ) || ( level[i] < lv && child[i].empty() ) ) {
+        if ( ( level[i] == lv ) || ( 0 <= level[i] && level[i] < lv && child[i].empty() ) ) {
           count++;
         }
       }
@@ -517,7 +2036,7 @@ namespace ran_forest
     {
       std::vector<size_t> re;
       for ( size_t i=0; i<child.size(); i++ ) {
-        if ( ( level[i] == lv ) || ( level[i] < lv && child[i].empty() ) ) {
+        if ( ( level[i] == lv ) || ( 0 <= level[i] && level[i] < lv && child[i].empty() ) ) {
           re.push_back( i );
         }
       }
@@ -534,11 +2053,19 @@ namespace ran_forest
       return static_cast<int>( roots.size() );
     }
 
-    inline size_t treeRoot( int treeID )
+    inline size_t treeRoot( int treeID ) const
     {
       return roots[treeID];
     }
 
+    // The bag of tree @param treeID: bit i of word i / 64 is set if
+    // data point i is one the tree was grown from. Empty if the bag is
+    // unknown, i.e. the tree was read from files written without it.
+    inline const std::vector<uint64_t>& treeBag( int treeID ) const
+    {
+      return bags[treeID];
+    }
+
     
     /* ---------- Extra ---------- */
 